@@ -11,6 +11,10 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <string.h>
+#include <time.h>
+#ifdef __x86_64__
+#include <cpuid.h>
+#endif
 
 
 // optimized gettimeofday()/time()
@@ -39,14 +43,136 @@
 
 #define REGET_TIME_US_GTOD   1
 #define REGET_TIME_US_TIME   1
-#define CPU_SPEED_GB    1  // assume a 1GB CPU
+#define CPU_SPEED_GB    1  // TSC ticks per ns, a guess until opt_clock_calibrate() is called
+
+
+// Calibrated TSC clock
+// opt_clock_ns() returns CLOCK_MONOTONIC nanoseconds, computed from the TSC without syscalls or locks
+//  1, the TSC is used only when it's invariant (constant rate in all P/C states), otherwise clock_gettime() is called each time
+//  2, the TSC rate is calibrated against CLOCK_MONOTONIC once in a process, on the first call, taking OPT_CLOCK_CALIBRATE_US,
+//     or earlier by calling opt_clock_calibrate(); opt_gettimeofday()/opt_time() use the rate once it is calibrated, but never calibrate
+//  3, each thread anchors to CLOCK_MONOTONIC again every OPT_CLOCK_ANCHOR_MS (sooner right after calibration), with the rate
+//     measured over the whole time since calibration, so that the clocks of different processes stay within a few hundred ns
+// Limitations:
+//  1, the TSCs of all the CPUs are assumed to be synchronized, as they are on a single socket or with invariant TSC on recent systems
+//  2, define OPT_CLOCK_NO_TSC to always use clock_gettime()
+//
+
+#define OPT_CLOCK_CALIBRATE_US	2000
+#define OPT_CLOCK_ANCHOR_MS	1000
+
+#define OPT_CLOCK_UNKNOWN	0
+#define OPT_CLOCK_CALIBRATING	1
+#define OPT_CLOCK_TSC	2
+#define OPT_CLOCK_MONOTONIC	3
+
+struct opt_clock_t
+{
+	volatile long state; // OPT_CLOCK_XXX, not changed after calibration
+	uint64_t tsc0, ns0; // where the calibration started
+	uint64_t ticks_per_us;
+};
+
+static inline uint64_t opt_monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Returns non-zero if the TSC runs at a constant rate, cpuid 0x80000007 EDX bit 8
+static inline int opt_tsc_invariant(void)
+{
+#if defined(__x86_64__) && !defined(OPT_CLOCK_NO_TSC)
+	unsigned int a, b, c, d;
+
+	if(!__get_cpuid(0x80000007, &a, &b, &c, &d))
+		return 0;
+	return (d>>8) & 1;
+#else
+	return 0;
+#endif
+}
+
+// The clock of this process, in whatever state it is
+static inline struct opt_clock_t *opt_clock(void)
+{
+	static struct opt_clock_t clk;
+	return &clk;
+}
+
+// Calibrate the TSC of this process once, the result is read-only afterwards
+static inline struct opt_clock_t *opt_clock_calibrate(void)
+{
+	struct opt_clock_t *clk = opt_clock();
+	uint64_t tsc, ns;
+
+	if(clk->state>=OPT_CLOCK_TSC)
+		return clk;
+	if(clk->state==OPT_CLOCK_UNKNOWN && CAS(&clk->state, 0UL, (unsigned long)OPT_CLOCK_CALIBRATING))
+	{
+		if(!opt_tsc_invariant())
+		{
+			clk->state = OPT_CLOCK_MONOTONIC;
+			return clk;
+		}
+		clk->ns0 = opt_monotonic_ns();
+		clk->tsc0 = RDTSC();
+		do
+		{
+			ns = opt_monotonic_ns();
+			tsc = RDTSC();
+		} while(ns-clk->ns0 < OPT_CLOCK_CALIBRATE_US*1000ULL);
+		clk->ticks_per_us = (tsc-clk->tsc0)*1000/(ns-clk->ns0);
+		__sync_synchronize();
+		clk->state = clk->ticks_per_us? OPT_CLOCK_TSC : OPT_CLOCK_MONOTONIC;
+	}
+	// being calibrated by another thread, which will be done in OPT_CLOCK_CALIBRATE_US
+	return clk;
+}
+
+// Returns the TSC ticks in a microsecond, or 0 if the TSC is not calibrated (yet), never calibrates
+static inline uint64_t opt_clock_ticks_per_us(void)
+{
+	struct opt_clock_t *clk = opt_clock();
+	return clk->state==OPT_CLOCK_TSC? clk->ticks_per_us : 0;
+}
+
+static inline uint64_t opt_clock_ns(void)
+{
+#ifdef __x86_64__
+	// the anchor of this thread
+	static __thread uint64_t tsc_anchor, ns_anchor, mult, max_ticks; // mult is ns per tick << 32
+	struct opt_clock_t *clk;
+	uint64_t tsc = RDTSC();
+
+	if(tsc-tsc_anchor < max_ticks)
+		return ns_anchor + (uint64_t)(((unsigned __int128)(tsc-tsc_anchor)*mult)>>32);
+	clk = opt_clock_calibrate();
+	if(clk->state!=OPT_CLOCK_TSC)
+		return opt_monotonic_ns();
+	ns_anchor = opt_monotonic_ns();
+	tsc_anchor = RDTSC();
+	mult = (uint64_t)((((unsigned __int128)(ns_anchor-clk->ns0))<<32)/(tsc_anchor-clk->tsc0));
+	// the rate is less precise shortly after calibration, anchor again sooner
+	max_ticks = clk->ticks_per_us*1000*OPT_CLOCK_ANCHOR_MS;
+	if(max_ticks > tsc_anchor-clk->tsc0)
+		max_ticks = tsc_anchor-clk->tsc0;
+	return ns_anchor;
+#else
+	return opt_monotonic_ns();
+#endif
+}
+
 
 static inline int opt_gettimeofday(struct timeval *tv, void *not_used)
 {
 	static volatile uint64_t walltick;
 	static volatile struct timeval walltime;
 	static volatile long lock = 0;
-	const unsigned int max_ticks = CPU_SPEED_GB*1000*REGET_TIME_US_GTOD;
+	// read each time, the TSC may be calibrated later by opt_clock_calibrate() or opt_clock_ns()
+	uint64_t ticks_per_us = opt_clock_ticks_per_us();
+	const uint64_t max_ticks = (ticks_per_us? ticks_per_us : CPU_SPEED_GB*1000)*REGET_TIME_US_GTOD;
 	
 	if(walltime.tv_sec==0 || (RDTSC()-walltick) > max_ticks)
 	{
@@ -71,7 +197,9 @@ static inline time_t opt_time(time_t *t)
 	static volatile uint64_t walltick;
 	static volatile struct timeval walltime;
 	static volatile long lock = 0;
-	const unsigned int max_ticks = CPU_SPEED_GB*1000*REGET_TIME_US_TIME;
+	// see opt_gettimeofday()
+	uint64_t ticks_per_us = opt_clock_ticks_per_us();
+	const uint64_t max_ticks = (ticks_per_us? ticks_per_us : CPU_SPEED_GB*1000)*REGET_TIME_US_TIME;
 	
 	if(walltime.tv_sec==0 || (RDTSC()-walltick) > max_ticks)
 	{
@@ -7,6 +7,9 @@
  *
  *  Based on implementation of transaction queue 基于事务队列的实现
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // memfd_create()
+#endif
 #include <stdint.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -18,47 +21,253 @@
 #include <sys/shm.h>
 #include <dirent.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <linux/futex.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "shm_queue.h"
 
+#ifndef SHM_HUGE_SHIFT
+#define SHM_HUGE_SHIFT	26
+#endif
+#ifndef SHM_HUGE_2MB
+#define SHM_HUGE_2MB	(21 << SHM_HUGE_SHIFT)
+#endif
+#ifndef SHM_HUGE_1GB
+#define SHM_HUGE_1GB	(30 << SHM_HUGE_SHIFT)
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND	2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE	3
+#endif
+#ifndef MPOL_F_MEMS_ALLOWED
+#define MPOL_F_MEMS_ALLOWED	(1<<2)
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB	0x0004U
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB	(21U << 26)
+#endif
+#ifndef MFD_HUGE_1GB
+#define MFD_HUGE_1GB	(30U << 26)
+#endif
+
 #define START_TOKEN    0x0000db03 // token to martk the valid start of a node
+#define PENDING_TOKEN  0x0000db04 // node claimed by a producer, data not committed yet (multi-producer mode)
+#define PAD_TOKEN      0x0000db05 // datalen nodes from here are skipped by the writer, e.g. on wrap around
+#define FREE_TOKEN     0x0000db06 // data consumed, the node can be reused once free_pos reaches here
+#define CHUNK_TOKEN    0x0000db07 // a chunk of large data, starting with struct sq_chunk_head_t, see sq_put_large()
+// With SQ_FLAG_SEQUENCE a token is (position<<3)|(token&7), see sq_token()
+#define SQ_TOKEN_KIND_MASK	7
+#define SQ_TOKEN_KIND(token)	((token) & SQ_TOKEN_KIND_MASK)
+
+// Data or chunk claimed by a reader and not released yet, the token is (pid<<3)|kind of the reader process,
+// so that the writer can take the nodes back if the reader exits without releasing them, see reclaim_node()
+#define READ_TOKEN        1
+#define READ_CHUNK_TOKEN  2
+#define SQ_READ_TOKEN(pid, token)	(((u32_t)(pid)<<3) | (SQ_TOKEN_KIND(token)==SQ_TOKEN_KIND(CHUNK_TOKEN)? READ_CHUNK_TOKEN : READ_TOKEN))
+#define SQ_IS_READ_TOKEN(token)	(SQ_TOKEN_KIND(token)==READ_TOKEN || SQ_TOKEN_KIND(token)==READ_CHUNK_TOKEN)
+
+// In multi-producer mode, an uncommitted node blocking the readers for this long
+// is treated as corrupted (its producer probably died before committing)
+#define PENDING_TIMEOUT_SEC	2
+
+// Subscribers of a broadcast queue wake the writers in sq_put_wait() without a barrier,
+// so the writers check again after this long in case a wakeup is missed
+#define SQ_BROADCAST_WAIT_MS	1
+
+// With SQ_FLAG_OVERWRITE, a writer finding the oldest data not committed yet, or being dropped by another thread,
+// yields this many times at most before taking the queue as full, see make_room()
+#define SQ_DROP_WAITS	1000
+
+// A reader waiting for the next chunk of large data checks this often if its writer is still alive
+#define SQ_CHUNK_WAIT_MS	100
 
 #define MAX_READER_PROC_NUM	64 // maximum allowable processes to be signaled when data arrived
+#define MAX_SUBSCRIBER_NUM	64 // maximum subscribers of a broadcast queue
+
+// x86 never reorders a store with older loads/stores, so a compiler barrier is enough to publish data
+#define BARRIER() __asm__ __volatile__("": : :"memory")
 
 #define CAS32(ptr, val_old, val_new)({ char ret; __asm__ __volatile__("lock; cmpxchgl %2,%0; setz %1": "+m"(*ptr), "=q"(ret): "r"(val_new),"a"(val_old): "memory"); ret;})
+#define CAS64(ptr, val_old, val_new)({ char ret; __asm__ __volatile__("lock; cmpxchgq %2,%0; setz %1": "+m"(*ptr), "=q"(ret): "r"((u64_t)(val_new)),"a"((u64_t)(val_old)): "memory"); ret;})
 
 static char errmsg[256];
 
+// Watermark callbacks of this process, see sq_set_watermarks()
+#define MAX_WATERMARK_QUEUES	16
+
+static struct
+{
+	struct sq_head_t *queue;
+	sq_watermark_fn fn;
+	void *arg;
+	volatile int above; // the high watermark was reached, and the low one not yet
+} watermark_cbs[MAX_WATERMARK_QUEUES];
+static int nr_watermark_cbs;
+
+// Lengths of the queues this process mapped from a file/memfd, see sq_destroy()
+// The length mapped may be more than the size in shm, e.g. the file rounded up to whole huge pages,
+// or grown after the queue was created. The table grows as needed
+static struct mapped_queue_t
+{
+	struct sq_head_t *queue;
+	long size;
+} *mapped_queues;
+static int nr_mapped_queues, max_mapped_queues;
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+
 const char *sq_errorstr()
 {
 	return errmsg;
 }
 
+// The full node header, the compact ones are its first 8 or 16 bytes, see node_head_size()
 struct sq_node_head_t
 {
-	u32_t start_token; // 0x0000db03, if the head position is corrupted, find next start token
+	u32_t start_token; // 0x0000db03, if the head position is corrupted, find next start token, see sq_token()
 	u32_t datalen; // length of stored data in this node
-	struct timeval enqueue_time;
+	union
+	{
+		struct timeval enqueue_time; // gettimeofday() when put
+		u64_t enqueue_ns; // opt_clock_ns() when put, with SQ_FLAG_CLOCK_NS or SQ_FLAG_HEADER_NS
+	};
 
-	// the actual data are stored here 真实的数据存储在这里
+	// the actual data are stored here with the full header, use SQ_NODE_DATA() for any header 真实的数据存储在这里
 	unsigned char data[0];
 
 } __attribute__((packed));
 
+// Written in front of each chunk of large data, in the node data
+struct sq_chunk_head_t
+{
+	u32_t total; // length of the whole data
+	u32_t offset; // where this chunk goes in the data, 0 for the first one
+	pid_t writer; // thread putting the data, see stream_writer
+	u32_t reserved;
+};
+
+// Claimed chunk nodes are told by the kind of their tokens, see SQ_READ_TOKEN()
+#define SQ_IS_CHUNK(node)	(SQ_TOKEN_KIND((node)->start_token)==READ_CHUNK_TOKEN)
+#define SQ_CHUNK(queue, node)	((struct sq_chunk_head_t *)SQ_NODE_DATA(queue, node))
+
+// Fields written by different sides are kept on separate cache lines,
+// so that a put doesn't invalidate the line the readers are polling, and vice versa
+#define SQ_CACHE_LINE	64
+#define SQ_CACHE_ALIGNED	__attribute__((aligned(SQ_CACHE_LINE)))
+
+// Changed whenever sq_head_t is changed, queues of another layout are refused
+#define SQ_LAYOUT_VERSION	0x53510011 // "SQ", version 17
+
+// The data area starts on a page boundary, see SQ_FLAG_MIRROR
+#define SQ_PAGE_SIZE	4096
+
+// Where the shm comes from, the queue layout is the same on all of them
+#define SQ_BACKEND_SYSV	0 // shmget()/shmat() with a numeric key
+#define SQ_BACKEND_MMAP	1 // mmap() of a POSIX shm, memfd or regular file
+
+// Counters are spread over shards by thread, so that threads counting at the same time don't share cache lines
+#define SQ_STAT_SHARDS	16
+
+struct sq_counters_t
+{
+	volatile u64_t puts;
+	volatile u64_t put_bytes;
+	volatile u64_t gets;
+	volatile u64_t get_bytes;
+	volatile u64_t full;
+	volatile u64_t cas_retries;
+	volatile u64_t corrupted;
+	volatile u64_t signals;
+	volatile u64_t dropped;
+	volatile u64_t expired;
+} SQ_CACHE_ALIGNED;
+
+// Latency histograms are sharded the same way, but fewer as they are much larger
+#define SQ_LATENCY_SHARDS	4
+#define SQ_LATENCY_SUB_BITS	4 // 16 buckets for each power of 2
+
+struct sq_latency_hist_t
+{
+	volatile u64_t count;
+	volatile u64_t total_ns;
+	volatile u64_t max_ns;
+	volatile u64_t buckets[SQ_LATENCY_BUCKETS];
+} SQ_CACHE_ALIGNED;
+
+// Read position of a subscriber of a broadcast queue
+struct sq_cursor_t
+{
+	volatile pid_t pid; // subscriber process, 0 if the cursor is not used
+	volatile int evicted; // set by the writer before overwriting data not read by this subscriber
+	volatile u64_t pos; // position of the next data to read, the writer doesn't go beyond it
+	u64_t cached_tail_pos; // subscriber's copy of tail_pos, refreshed only when no data is left
+} SQ_CACHE_ALIGNED;
+
 struct sq_head_t
 {
+	// not changed after creation, except the signal parameters set by the writer
+	u32_t version; // SQ_LAYOUT_VERSION
 	int ele_size;
 	int ele_count;
-
-	volatile int head_pos; // head position in the queue, pointer for reading
-	volatile int tail_pos; // tail position in the queue, pointer for writting
+	int flags; // SQ_FLAG_XXX given to sq_create_ex()
+	int node_shift; // log2 of the node size with SQ_FLAG_POW2
+	int head_size; // bytes of the node header, by SQ_FLAG_HEADER_XXX
+	u32_t notify_id; // unique id of this queue, used for naming the notification sockets
+	long shm_size; // bytes allocated when created, a file mapped shorter than this has been truncated
 
 	int data_signum; // signum to send to the reader processes if requested
 	int sig_node_num; // send signal to processes when data node excceeds this count
 	int sig_process_num; // send signal to up to this number of processes each time
+	volatile long long ttl_ns; // data older than this are skipped by the readers, 0 for no TTL, see sq_set_ttl()
+	volatile u64_t pos_lap; // (hi<<32)|hi%ele_count for the high half hi of the newest position, see pos_mod()
+
+	// written by the writers
+	volatile u64_t tail_pos SQ_CACHE_ALIGNED; // tail position in the queue, pointer for writting
+	volatile u64_t cached_free_pos; // writers' copy of free_pos, refreshed only when the queue looks full
+
+	// written by the readers on each get
+	volatile u64_t head_pos SQ_CACHE_ALIGNED; // head position in the queue, pointer for reading
+	volatile u64_t cached_tail_pos; // readers' copy of tail_pos, refreshed only when the queue looks empty
+	volatile u64_t stall_mark; // (position<<32)|time, where and since when readers wait for an uncommitted node
+	volatile u64_t high_water; // most nodes in use seen by the readers, only written when it grows
+
+	// written by the readers on release, read by the writers only when the queue looks full
+	volatile u64_t free_pos SQ_CACHE_ALIGNED; // nodes from free_pos to head_pos are still being read, writer must not touch them
 
-	volatile int pidnum; // number of processes currently registered for signal delivery 
+	volatile u32_t data_futex SQ_CACHE_ALIGNED; // increased on each wakeup, readers in sq_wait() sleep on it
+	volatile int data_waiters; // number of readers sleeping in sq_wait()
+
+	// written by the writers blocked in sq_put_wait(), read by the readers on release
+	volatile u32_t space_futex SQ_CACHE_ALIGNED; // increased on each wakeup, writers in sq_put_wait() sleep on it
+	volatile int space_waiters; // number of writers sleeping in sq_put_wait()
+	int watermark_high; // used nodes, see sq_set_watermarks(), 0 if not set
+	int watermark_low; // writers in sq_put_wait() are woken when no more nodes than this are used
+
+	// large data put in chunks, see sq_put_large()
+	volatile pid_t stream_writer SQ_CACHE_ALIGNED; // thread putting the chunks, in multi-producer mode the others don't claim nodes meanwhile
+	volatile pid_t stream_reader; // thread reading the chunks, the only one taking those after the first
+
+	volatile int pidnum SQ_CACHE_ALIGNED; // number of processes currently registered for signal delivery 
 	volatile pid_t pidset[MAX_READER_PROC_NUM]; // registered pid list
 	volatile uint8_t sigmask[(MAX_READER_PROC_NUM+7)/8]; // bit map for pid waiting on signal
+	volatile uint8_t fdmask[(MAX_READER_PROC_NUM+7)/8]; // bit map for pid notified through fd instead of signal
+
+	struct sq_cursor_t cursors[MAX_SUBSCRIBER_NUM]; // subscribers of a broadcast queue
+
+	struct sq_counters_t counters[SQ_STAT_SHARDS]; // summed up by sq_get_stat()
+	struct sq_latency_hist_t latency[SQ_LATENCY_SHARDS]; // with SQ_FLAG_LATENCY, summed up by sq_get_latency()
 	/*
 	 按照posix标准，一般整形对应的*_t类型为：
      1字节     uint8_t
@@ -66,37 +275,77 @@ struct sq_head_t
      4字节     uint32_t
      8字节     uint64_t
 	*/
-	struct sq_node_head_t nodes[0];
+	struct sq_node_head_t nodes[0] __attribute__((aligned(SQ_PAGE_SIZE))); // so that the data area can be mapped by itself
 };
 
-// Increase head/tail by val
-#define SQ_ADD_HEAD(queue, val) 	(((queue)->head_pos+(val))%((queue)->ele_count+1))
-#define SQ_ADD_TAIL(queue, val) 	(((queue)->tail_pos+(val))%((queue)->ele_count+1))
+#define SQ_IS_POW2(queue)	((queue)->flags & SQ_FLAG_POW2)
+
+// Returns pos%ele_count with one 32-bit division, as the 32-bit positions took, a 64-bit one takes several times
+// longer on most x86 CPUs. divl divides (hi%ele_count)<<32|lo, whose quotient fits in 32 bits, and hi%ele_count
+// is kept in the queue by the writers, see place_nodes(), changing once in 2^32 positions.
+// Positions of another hi, around the change, work it out each time
+static inline u32_t pos_mod(struct sq_head_t *queue, u64_t pos)
+{
+	u64_t lap = queue->pos_lap;
+	u32_t hi = (u32_t)(pos>>32), q, r;
 
-// Next position after head/tail
-#define SQ_NEXT_HEAD(queue) 	SQ_ADD_HEAD(queue, 1)
-#define SQ_NEXT_TAIL(queue) 	SQ_ADD_TAIL(queue, 1)
+	if(hi!=(u32_t)(lap>>32))
+		lap = hi % (u32_t)queue->ele_count;
+	__asm__("divl %4" : "=a"(q), "=d"(r) : "a"((u32_t)pos), "d"((u32_t)lap), "rm"((u32_t)queue->ele_count));
+	return r;
+}
 
-#define SQ_ADD_POS(queue, pos, val)     (((pos)+(val))%((queue)->ele_count+1))
+// Positions only increase, the node of position pos is at index pos%ele_count
+#define SQ_IDX(queue, pos)	((int)(SQ_IS_POW2(queue)? (pos)&((queue)->ele_count-1) : pos_mod((queue), (pos))))
 
-#define SQ_IS_QUEUE_FULL(queue) 	(SQ_NEXT_TAIL(queue)==(queue)->head_pos)
+#define SQ_IS_QUEUE_FULL(queue) 	(SQ_USED_NODES(queue)==(queue)->ele_count)
 #define SQ_IS_QUEUE_EMPTY(queue)	((queue)->tail_pos==(queue)->head_pos)
 
-#define SQ_EMPTY_NODES(queue) 	(((queue)->head_pos+(queue)->ele_count-(queue)->tail_pos) % ((queue)->ele_count+1))
-#define SQ_USED_NODES(queue) 	((queue)->ele_count - SQ_EMPTY_NODES(queue))
+#define SQ_USED_NODES(queue) 	((int)((queue)->tail_pos-(queue)->head_pos))
+#define SQ_EMPTY_NODES(queue) 	((queue)->ele_count - SQ_USED_NODES(queue))
 
-#define SQ_EMPTY_NODES2(queue, head) (((head)+(queue)->ele_count-(queue)->tail_pos) % ((queue)->ele_count+1)) 
-#define SQ_USED_NODES2(queue, head) ((queue)->ele_count - SQ_EMPTY_NODES2(queue, head))
+#define SQ_USED_NODES3(queue, head, tail) ((int)((tail)-(head)))
+#define SQ_EMPTY_NODES3(queue, head, tail) ((queue)->ele_count - SQ_USED_NODES3(queue, head, tail))
 
 // The size of a node
-#define SQ_NODE_SIZE_ELEMENT(ele_size)	(sizeof(struct sq_node_head_t)+ele_size)
-#define SQ_NODE_SIZE(queue)            	(SQ_NODE_SIZE_ELEMENT((queue)->ele_size))
+#define SQ_NODE_SIZE_ELEMENT(head_size, ele_size)	((head_size)+(ele_size))
+#define SQ_NODE_SIZE(queue)            	(SQ_NODE_SIZE_ELEMENT((queue)->head_size, (queue)->ele_size))
+
+// Where the data of a node are
+#define SQ_NODE_DATA(queue, node)	((unsigned char *)(node) + (queue)->head_size)
 
 // Convert an index to a node_head pointer
-#define SQ_GET(queue, idx) ((struct sq_node_head_t *)(((char*)(queue)->nodes) + (idx)*SQ_NODE_SIZE(queue)))
+#define SQ_GET(queue, idx) ((struct sq_node_head_t *)(((char*)(queue)->nodes) + \
+	(SQ_IS_POW2(queue)? (long)(idx)<<(queue)->node_shift : (long)(idx)*SQ_NODE_SIZE(queue))))
+
+// Convert a node_head pointer back to its index
+#define SQ_NODE_IDX(queue, node) ((int)(SQ_IS_POW2(queue)? ((char*)(node)-(char*)(queue)->nodes)>>(queue)->node_shift : \
+	((char*)(node)-(char*)(queue)->nodes)/(long)SQ_NODE_SIZE(queue)))
 
 // Estimate how many nodes are needed by this length
-#define SQ_NUM_NEEDED_NODES(queue, datalen) 	((datalen) + sizeof(struct sq_node_head_t) + SQ_NODE_SIZE(queue) -1) / SQ_NODE_SIZE(queue)
+#define SQ_NUM_NEEDED_NODES(queue, datalen) 	((int)(SQ_IS_POW2(queue)? \
+	((datalen) + (queue)->head_size + SQ_NODE_SIZE(queue) -1) >> (queue)->node_shift : \
+	((datalen) + (queue)->head_size + SQ_NODE_SIZE(queue) -1) / SQ_NODE_SIZE(queue)))
+
+#define SQ_IS_MULTI_PRODUCER(queue)	((queue)->flags & SQ_FLAG_MULTI_PRODUCER)
+#define SQ_IS_BROADCAST(queue)	((queue)->flags & SQ_FLAG_BROADCAST)
+#define SQ_HAS_LATENCY(queue)	((queue)->flags & SQ_FLAG_LATENCY)
+#define SQ_HAS_CLOCK_NS(queue)	((queue)->flags & (SQ_FLAG_CLOCK_NS|SQ_FLAG_HEADER_NS))
+#define SQ_HAS_TIMESTAMP(queue)	(!((queue)->flags & SQ_FLAG_HEADER_NONE))
+#define SQ_IS_MIRROR(queue)	((queue)->flags & SQ_FLAG_MIRROR)
+#define SQ_IS_SEQUENCE(queue)	((queue)->flags & SQ_FLAG_SEQUENCE)
+#define SQ_IS_OVERWRITE(queue)	((queue)->flags & SQ_FLAG_OVERWRITE)
+
+// Bytes of the data area, and of the address range mapped for a queue of shm_size bytes with SQ_FLAG_MIRROR
+#define SQ_DATA_SIZE(queue)	((long)SQ_NODE_SIZE(queue)*(queue)->ele_count)
+#define SQ_MIRROR_SIZE(queue, shm_size)	((long)offsetof(struct sq_head_t, nodes)+2*SQ_DATA_SIZE(queue) > (long)(shm_size)? \
+	(long)offsetof(struct sq_head_t, nodes)+2*SQ_DATA_SIZE(queue) : (long)(shm_size))
+
+// Flags accepted by sq_open_xxx()
+#define SQ_FLAGS_OPEN	(SQ_FLAG_PREFAULT|SQ_FLAG_MLOCK|SQ_FLAG_READONLY)
+
+// Add n to counter name of the calling thread's shard
+#define SQ_STAT_ADD(queue, name, n)	__sync_fetch_and_add(&my_counters(queue)->name, (n))
 
 
 // optimized gettimeofday
@@ -190,7 +439,7 @@ int sq_register_signal(struct sq_head_t *sq)
 			// if i is taken by someone else, try next
 			// else set pidset[i] to our pid and return i
 			if(CAS32(&sq->pidset[i], 0, pid))
-				return i;
+				goto registered;
 		}
 	}
 
@@ -205,9 +454,80 @@ int sq_register_signal(struct sq_head_t *sq)
 		if(CAS32(&sq->pidnum, pidnum, pidnum+1))
 		{
 			sq->pidset[pidnum] = (volatile pid_t)pid;
-			return pidnum;
+			i = pidnum;
+			break;
 		}
 	}
+
+registered:
+	// notified by signal unless sq_register_fd() says otherwise
+	__sync_fetch_and_and(sq->fdmask+(i/8), (uint8_t)~(1U<<(i%8)));
+	return i;
+}
+
+// Name of the notification socket of reader sigindex
+static socklen_t notify_addr(struct sq_head_t *sq, int sigindex, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	// abstract namespace, the name disappears with the socket
+	snprintf(addr->sun_path+1, sizeof(addr->sun_path)-1, "shm_queue.%08x.%d", sq->notify_id, sigindex);
+	return offsetof(struct sockaddr_un, sun_path)+1+strlen(addr->sun_path+1);
+}
+
+// Register the current process like sq_register_signal(), but get notified through a file descriptor
+// Returns a signal index for sq_sigon/sq_sigoff with *fd set, or < 0 on failure
+int sq_register_fd(struct sq_head_t *sq, int *fd)
+{
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+	int sigindex;
+
+	if(sq==NULL || fd==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	sigindex = sq_register_signal(sq);
+	if(sigindex<0)
+		return sigindex;
+
+	*fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if(*fd<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "socket: %s", strerror(errno));
+		return -1;
+	}
+	addrlen = notify_addr(sq, sigindex, &addr);
+	if(bind(*fd, (struct sockaddr *)&addr, addrlen)<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "bind: %s", strerror(errno));
+		close(*fd);
+		return -1;
+	}
+	__sync_fetch_and_or(sq->fdmask+(sigindex/8), (uint8_t)1<<(sigindex%8));
+	return sigindex;
+}
+
+// Consume the notifications on fd returned by sq_register_fd()
+void sq_clear_fd(int fd)
+{
+	char buf[64];
+	while(recv(fd, buf, sizeof(buf), MSG_DONTWAIT)>0);
+}
+
+// Wake up reader sigindex registered by sq_register_fd()
+static void notify_fd(struct sq_head_t *sq, int sigindex)
+{
+	static int sock = -1; // shared by all the queues in this process
+	struct sockaddr_un addr;
+	socklen_t addrlen;
+
+	if(sock<0 && (sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0))<0)
+		return;
+	addrlen = notify_addr(sq, sigindex, &addr);
+	// if the socket buffer is full, the reader has been notified already
+	sendto(sock, "", 1, MSG_DONTWAIT, (struct sockaddr *)&addr, addrlen);
 }
 
 
@@ -239,47 +559,328 @@ int sq_sigoff(struct sq_head_t *sq, int sigindex)
 }
 
 
+// Apply the NUMA policy in options to a new shm, before any page is touched
+// Failures are not fatal, e.g. on a single node machine, the pages are then placed as usual
+static void set_numa_policy(char *shm, long size, int options)
+{
+	unsigned long mask[256/(8*sizeof(long))]; // nodes encoded in SQ_FLAG_NUMA_BIND()
+	int mode, node;
+
+	memset(mask, 0, sizeof(mask));
+	if(options & SQ_FLAG_NUMA_INTERLEAVE)
+	{
+		mode = MPOL_INTERLEAVE;
+		if(syscall(SYS_get_mempolicy, NULL, mask, sizeof(mask)*8, NULL, MPOL_F_MEMS_ALLOWED)<0)
+		{
+			printf("get_mempolicy: %s, NUMA policy ignored\n", strerror(errno));
+			return;
+		}
+	}
+	else if(options & SQ_FLAG_NUMA_BIND(0))
+	{
+		mode = MPOL_BIND;
+		node = SQ_FLAG_NUMA_NODE(options);
+		mask[node/(8*sizeof(long))] |= 1UL<<(node%(8*sizeof(long)));
+	}
+	else // SQ_FLAG_NUMA_FIRST_TOUCH, placed by whoever touches the page first
+	{
+		return;
+	}
+	// the kernel takes maxnode-1 bits from mask
+	if(syscall(SYS_mbind, shm, size, mode, mask, sizeof(mask)*8+1, 0)<0)
+		printf("mbind: %s, NUMA policy ignored\n", strerror(errno));
+}
+
+// Prepare the pages of the shm as options ask:
+// the NUMA policy is applied to a new shm, then all the pages are locked/mapped with SQ_FLAG_MLOCK/SQ_FLAG_PREFAULT
+// Returns 0 on success, -1 with errmsg set if failed
+static int map_pages(char *shm, long size, int created, int options)
+{
+	long i, page_size;
+
+	if(created && (options & SQ_FLAGS_NUMA))
+		set_numa_policy(shm, size, options);
+
+	// avoid swapping  //防止这块内存页被操作系统交换
+	if((options & SQ_FLAG_MLOCK) && mlock(shm, size)<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "mlock: %s", strerror(errno));
+		return -1;
+	}
+	if(options & SQ_FLAG_PREFAULT)
+	{
+		// map every page now, instead of faulting on the first access
+		page_size = getpagesize();
+		for(i=0; i<size; i+=page_size)
+			(void)((volatile char *)shm)[i];
+	}
+	return 0;
+}
+
+// Returns the shard of counters of the calling thread
+// A process forked after counting shares its parent's shard, the counters are added atomically for that
+static inline int my_shard()
+{
+	static __thread int shard = -1;
+
+	if(shard<0)
+		shard = (u32_t)syscall(SYS_gettid) % SQ_STAT_SHARDS;
+	return shard;
+}
+
+// pid of this process, getpid() is a syscall for each get otherwise
+static pid_t my_pid;
+
+static void reset_pid(void)
+{
+	my_pid = getpid();
+}
+
+__attribute__((constructor)) static void init_pid(void)
+{
+	reset_pid();
+	pthread_atfork(NULL, NULL, reset_pid); // the child has a pid of its own
+}
+
+static inline struct sq_counters_t *my_counters(struct sq_head_t *queue)
+{
+	return queue->counters+my_shard();
+}
+
 // shm operation wrapper  
-static char *attach_shm(long iKey, long iSize, int iFlag)
+// When creating, SQ_FLAG_HUGETLB/SQ_FLAG_HUGETLB_1GB in options ask for huge pages, smaller pages are used if not available
+// SQ_FLAG_PREFAULT/SQ_FLAG_MLOCK in options map/lock all the pages in advance, SQ_FLAG_READONLY maps them read-only
+static char *attach_shm(long iKey, long iSize, int iFlag, int options)
 {
-	int shmid;
+	int shmid = -1;
 	char* shm;
+	struct shmid_ds ds;
 
-	if((shmid=shmget(iKey, iSize, iFlag)) < 0)
+	if((iFlag & IPC_CREAT) && (options & SQ_FLAG_HUGETLB_1GB))
+	{
+		shmid = shmget(iKey, (iSize + (1UL<<30) - 1) & (~((1UL<<30)-1)), iFlag|SHM_HUGETLB|SHM_HUGE_1GB);
+		if(shmid<0)
+			printf("shmget(key=%ld) with 1GB huge pages: %s, trying 2MB pages\n", iKey, strerror(errno));
+	}
+	if(shmid<0 && (iFlag & IPC_CREAT) && (options & (SQ_FLAG_HUGETLB|SQ_FLAG_HUGETLB_1GB)))
+	{
+		// iSize is aligned to 4MB already
+		shmid = shmget(iKey, iSize, iFlag|SHM_HUGETLB|SHM_HUGE_2MB);
+		if(shmid<0)
+			printf("shmget(key=%ld) with 2MB huge pages: %s, trying normal pages\n", iKey, strerror(errno));
+	}
+	if(shmid<0 && (shmid=shmget(iKey, iSize, iFlag)) < 0)
 	{
 		printf("shmget(key=%ld, size=%ld): %s\n", iKey, iSize, strerror(errno)); 
 		return NULL;
 	}
 
-	if((shm=shmat(shmid, NULL ,0))==(char *)-1)
+	if((shm=shmat(shmid, NULL, (options & SQ_FLAG_READONLY)? SHM_RDONLY : 0))==(char *)-1)
 	{
 		perror("shmat");
 		return NULL;
 	}
 
-/*TODO:
-	// avoid swapping  //防止这块内存页被操作系统交换
-	if(mlock(shm, iSize)<0)
+	if((options & (SQ_FLAG_PREFAULT|SQ_FLAG_MLOCK)) || ((iFlag & IPC_CREAT) && (options & SQ_FLAGS_NUMA)))
 	{
-		perror("mlock");
-		shmdt(shm);
+		if(shmctl(shmid, IPC_STAT, &ds)<0)
+		{
+			snprintf(errmsg, sizeof(errmsg), "shmctl: %s", strerror(errno));
+			shmdt(shm);
+			return NULL;
+		}
+		if(map_pages(shm, ds.shm_segsz, iFlag & IPC_CREAT, options)<0)
+		{
+			shmdt(shm);
+			if(iFlag & IPC_CREAT) // don't leave an uninitialized queue behind
+				shmctl(shmid, IPC_RMID, NULL);
+			return NULL;
+		}
+	}
+	return shm;
+}
+
+// mmap() wrapper for the backends other than SysV shm
+// If created is set, fd is a new empty file, which is extended to iSize bytes
+// Returns the mapped address with *size set to the bytes mapped, or NULL if failed
+static char *attach_fd(int fd, long iSize, int created, int options, long *size)
+{
+	struct stat st;
+	char *shm;
+
+	if(fstat(fd, &st)<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "fstat: %s", strerror(errno));
+		return NULL;
+	}
+	if(created)
+	{
+		// a file of huge pages must be extended in whole pages
+		if(st.st_blksize>0)
+			iSize = (iSize + st.st_blksize - 1) / st.st_blksize * st.st_blksize;
+		if(ftruncate(fd, iSize)<0)
+		{
+			snprintf(errmsg, sizeof(errmsg), "ftruncate: %s", strerror(errno));
+			return NULL;
+		}
+		st.st_size = iSize;
+	}
+	if(st.st_size<(off_t)sizeof(struct sq_head_t))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Queue not initialized");
 		return NULL;
 	}
-*/
+	if((shm=mmap(NULL, st.st_size, (options & SQ_FLAG_READONLY)? PROT_READ : PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0))==MAP_FAILED)
+	{
+		snprintf(errmsg, sizeof(errmsg), "mmap: %s", strerror(errno));
+		return NULL;
+	}
+	if(map_pages(shm, st.st_size, created, options)<0)
+	{
+		munmap(shm, st.st_size);
+		return NULL;
+	}
+	*size = st.st_size;
 	return shm;
 }
 
+// Map the queue in fd, which is mapped at shm for size bytes, again with its data area mapped twice back to back,
+// so that data running over the end of the ring are continued from its beginning (SQ_FLAG_MIRROR)
+// Returns the new address replacing shm, or NULL if failed, in which case shm is still mapped
+static char *mirror_fd(int fd, struct sq_head_t *shm, long size, int options)
+{
+	long data_offset = offsetof(struct sq_head_t, nodes), data_size = SQ_DATA_SIZE(shm);
+	long total = SQ_MIRROR_SIZE(shm, size);
+	int prot = (options & SQ_FLAG_READONLY)? PROT_READ : PROT_READ|PROT_WRITE;
+	char *addr;
+
+	if(data_size % getpagesize())
+	{
+		snprintf(errmsg, sizeof(errmsg), "Data area of %ld bytes is not in whole pages", data_size);
+		return NULL;
+	}
+	// reserve the whole range first, then map the file over it
+	if((addr=mmap(NULL, total, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0))==MAP_FAILED)
+	{
+		snprintf(errmsg, sizeof(errmsg), "mmap: %s", strerror(errno));
+		return NULL;
+	}
+	if(mmap(addr, size, prot, MAP_SHARED|MAP_FIXED, fd, 0)==MAP_FAILED ||
+		mmap(addr+data_offset+data_size, data_size, prot, MAP_SHARED|MAP_FIXED, fd, data_offset)==MAP_FAILED)
+	{
+		snprintf(errmsg, sizeof(errmsg), "mmap: %s", strerror(errno));
+		munmap(addr, total);
+		return NULL;
+	}
+	if(map_pages(addr, total, 0, options)<0)
+	{
+		munmap(addr, total);
+		return NULL;
+	}
+	munmap(shm, size);
+	return addr;
+}
+
+// Unmap a queue mapped by attach_shm()/attach_fd()
+static void detach_shm(struct sq_head_t *shm, int backend, long size)
+{
+	if(backend==SQ_BACKEND_SYSV)
+		shmdt(shm);
+	else
+		munmap(shm, size);
+}
+
+// Returns the bytes of the node header for queue flags
+static int node_head_size(int flags)
+{
+	if(flags & SQ_FLAG_HEADER_NONE) // token and length only
+		return offsetof(struct sq_node_head_t, enqueue_time);
+	if(flags & SQ_FLAG_HEADER_NS) // and enqueue_ns
+		return offsetof(struct sq_node_head_t, enqueue_time) + sizeof(u64_t);
+	return sizeof(struct sq_node_head_t);
+}
+
+// Remember that queue is mapped for size bytes in this process
+// Returns 0 on success, -1 if out of memory
+static int add_mapped_queue(struct sq_head_t *queue, long size)
+{
+	struct mapped_queue_t *table;
+	int ret = 0;
+
+	pthread_mutex_lock(&mapped_lock);
+	if(nr_mapped_queues==max_mapped_queues)
+	{
+		if((table = realloc(mapped_queues, sizeof(*table)*(max_mapped_queues? max_mapped_queues*2 : 16)))!=NULL)
+		{
+			mapped_queues = table;
+			max_mapped_queues = max_mapped_queues? max_mapped_queues*2 : 16;
+		}
+		else
+			ret = -1;
+	}
+	if(ret==0)
+	{
+		mapped_queues[nr_mapped_queues].queue = queue;
+		mapped_queues[nr_mapped_queues++].size = size;
+	}
+	pthread_mutex_unlock(&mapped_lock);
+	if(ret<0)
+		snprintf(errmsg, sizeof(errmsg), "Out of memory");
+	return ret;
+}
+
+// Forget queue mapped in this process
+// Returns the bytes it is mapped for, or -1 if it is not mapped from a file
+static long remove_mapped_queue(struct sq_head_t *queue)
+{
+	long size = -1;
+	int i;
+
+	pthread_mutex_lock(&mapped_lock);
+	for(i=0; i<nr_mapped_queues && mapped_queues[i].queue!=queue; i++);
+	if(i<nr_mapped_queues)
+	{
+		size = mapped_queues[i].size;
+		mapped_queues[i] = mapped_queues[--nr_mapped_queues]; // removed by moving the last one here
+	}
+	pthread_mutex_unlock(&mapped_lock);
+	return size;
+}
+
 // shm operation wrapper  //shm操作包装
-static struct sq_head_t *open_shm_queue(long shm_key, long ele_size, long ele_count, int create)
+// The queue is in SysV shm shm_key, or mapped from fd if fd>=0, which is a new empty file if created is set
+static struct sq_head_t *open_shm_queue(long shm_key, int fd, int created, long ele_size, long ele_count, int flags, int create)
 {
-	long allocate_size;
+	long allocate_size, shm_size = 0;
 	struct sq_head_t *shm;
+	int backend = fd>=0? SQ_BACKEND_MMAP : SQ_BACKEND_SYSV;
+	int node_shift = 0;
+	int options = flags & SQ_FLAGS_ATTACH;
+	int head_size;
+
+	flags &= ~SQ_FLAGS_ATTACH; // the others are fixed for the queue
+	head_size = node_head_size(flags);
 
 	if(create)
 	{
-		ele_size = (((ele_size + 7)>>3) << 3); // align to 8 bytes (ele_size+7)&~7;
-		// We need an extra element for ending control
-		allocate_size = sizeof(struct sq_head_t) + SQ_NODE_SIZE_ELEMENT(ele_size)*(ele_count+1);
+		if(flags & SQ_FLAG_POW2)
+		{
+			// index and offset of a node are then taken by mask and shift
+			while((1L<<node_shift) < (long)SQ_NODE_SIZE_ELEMENT(head_size, ele_size))
+				node_shift ++;
+			ele_size = (1L<<node_shift) - head_size;
+			while(ele_count & (ele_count-1))
+				ele_count = (ele_count | (ele_count-1)) + 1;
+		}
+		else
+		{
+			ele_size = (((ele_size + 7)>>3) << 3); // align to 8 bytes (ele_size+7)&~7;
+		}
+		// a mirrored data area is mapped in whole pages, powers of 2 stay powers of 2 here
+		while((flags & SQ_FLAG_MIRROR) && SQ_NODE_SIZE_ELEMENT(head_size, ele_size)*ele_count % SQ_PAGE_SIZE)
+			ele_count ++;
+		// positions never wrap around, so head==tail is always empty, no extra element is needed
+		allocate_size = sizeof(struct sq_head_t) + SQ_NODE_SIZE_ELEMENT(head_size, ele_size)*ele_count;
 		// Align to 4MB boundary
 		allocate_size = (allocate_size + (4UL<<20) - 1) & (~((4UL<<20)-1));  //4M对齐
 		printf("shm size needed for queue - %lu.\n", allocate_size);
@@ -289,29 +890,83 @@ static struct sq_head_t *open_shm_queue(long shm_key, long ele_size, long ele_co
 		allocate_size = 0;
 	}
 
-	if (!(shm = (struct sq_head_t *)attach_shm(shm_key, allocate_size, 0666)))
+	if(backend==SQ_BACKEND_MMAP)
 	{
-		if (!create) return NULL;
-		if (!(shm = (struct sq_head_t *)attach_shm(shm_key, allocate_size, 0666|IPC_CREAT)))
-			return NULL;
+		shm = (struct sq_head_t *)attach_fd(fd, allocate_size, created, options, &shm_size);
+	}
+	else if(!(shm = (struct sq_head_t *)attach_shm(shm_key, allocate_size, (options & SQ_FLAG_READONLY)? 0444 : 0666, options)) &&
+		create && !errmsg[0])
+	{
+		shm = (struct sq_head_t *)attach_shm(shm_key, allocate_size, 0666|IPC_CREAT, options);
+		created = 1;
+	}
+	if(shm==NULL)
+		return NULL;
 
-		memset(shm, 0, allocate_size);
+	if(created)
+	{
+		// a new shm is zero filled already, but touching all the pages here saves page faults later,
+		// unless the pages are to be placed near the first process touching them
+		memset(shm, 0, (options & SQ_FLAG_NUMA_FIRST_TOUCH)? (long)sizeof(struct sq_head_t) : allocate_size);
+		shm->version = SQ_LAYOUT_VERSION;
 		shm->ele_size = ele_size;
 		shm->ele_count = ele_count;
-		return shm;
+		shm->flags = flags;
+		shm->node_shift = node_shift;
+		shm->head_size = head_size;
+		shm->notify_id = (u32_t)RDTSC() ^ ((u32_t)getpid()<<16) ^ (u32_t)shm_key;
+		shm->watermark_low = ele_count; // wake blocked writers whenever nodes are freed
+		shm->shm_size = allocate_size;
+		goto mirror;
+	}
+	if(shm->version!=SQ_LAYOUT_VERSION) // created by an incompatible version of shm_queue
+	{
+		printf("shm layout version mismatched: 0x%x in shm, 0x%x expected\n", shm->version, SQ_LAYOUT_VERSION);
+		detach_shm(shm, backend, shm_size);
+		return NULL;
+	}
+	if(backend==SQ_BACKEND_MMAP && shm_size<shm->shm_size) // the nodes beyond the end of the file would raise SIGBUS
+	{
+		snprintf(errmsg, sizeof(errmsg), "Queue file of %ld bytes is shorter than the queue of %ld bytes", shm_size, shm->shm_size);
+		detach_shm(shm, backend, shm_size);
+		return NULL;
 	}
-	else if(create) // verify parameters if open for writing 
+	if(create) // verify parameters if open for writing 
 	{
-		if(shm->ele_size!=ele_size || shm->ele_count!=ele_count) 
+		if(shm->ele_size!=ele_size || shm->ele_count!=ele_count || shm->flags!=flags) 
 		{
 			printf("shm parameters mismatched: \n");
-			printf("    given:  ele_size=%ld, ele_count=%ld\n", ele_size, ele_count);
-			printf("    in shm: ele_size=%d, ele_count=%d\n", shm->ele_size, shm->ele_count);
-			shmdt(shm);
+			printf("    given:  ele_size=%ld, ele_count=%ld, flags=0x%x\n", ele_size, ele_count, flags);
+			printf("    in shm: ele_size=%d, ele_count=%d, flags=0x%x\n", shm->ele_size, shm->ele_count, shm->flags);
+			detach_shm(shm, backend, shm_size);
 			return NULL;
 		}
 	}
 
+mirror:
+	if(SQ_IS_MIRROR(shm))
+	{
+		struct sq_head_t *mirrored;
+
+		if(backend!=SQ_BACKEND_MMAP) // SysV shm can only be attached as a whole
+		{
+			snprintf(errmsg, sizeof(errmsg), "SQ_FLAG_MIRROR needs a POSIX shm, file or memfd queue");
+			detach_shm(shm, backend, shm_size);
+			return NULL;
+		}
+		if((mirrored = (struct sq_head_t *)mirror_fd(fd, shm, shm_size, options))==NULL)
+		{
+			detach_shm(shm, backend, shm_size);
+			return NULL;
+		}
+		shm = mirrored;
+		shm_size = SQ_MIRROR_SIZE(shm, shm_size);
+	}
+	if(backend==SQ_BACKEND_MMAP && add_mapped_queue(shm, shm_size)<0)
+	{
+		detach_shm(shm, backend, shm_size);
+		return NULL;
+	}
 	return shm;
 }
 
@@ -323,18 +978,48 @@ static struct sq_head_t *open_shm_queue(long shm_key, long ele_size, long ele_co
 //     ele_count    - preallocated number of elements
 // Returns a shm queue pointer or NULL if failed
 struct sq_head_t *sq_create(u64_t shm_key, int ele_size, int ele_count)
+{
+	return sq_create_ex(shm_key, ele_size, ele_count, 0);
+}
+
+// Returns non-zero if the parameters are valid for creating a queue
+static int check_create_args(int ele_size, int ele_count, int flags)
+{
+	return ele_size>0 && ele_count>0 &&
+		!(flags & ~(SQ_FLAG_MULTI_PRODUCER|SQ_FLAG_POW2|SQ_FLAG_BROADCAST|SQ_FLAG_EVICT_LAGGARDS|SQ_FLAG_LATENCY|SQ_FLAG_CLOCK_NS|
+			SQ_FLAG_HEADER_NS|SQ_FLAG_HEADER_NONE|SQ_FLAG_MIRROR|SQ_FLAG_SEQUENCE|SQ_FLAG_OVERWRITE|SQ_FLAGS_ATTACH)) &&
+		!((flags & SQ_FLAG_HEADER_NONE) && (flags & (SQ_FLAG_HEADER_NS|SQ_FLAG_CLOCK_NS|SQ_FLAG_LATENCY))) && // no timestamp
+		!((flags & SQ_FLAG_POW2) && ele_count>(1<<30)) &&
+		!((flags & SQ_FLAG_BROADCAST) && (flags & SQ_FLAG_MULTI_PRODUCER)) && // the writer keeps free_pos by itself
+		!((flags & SQ_FLAG_EVICT_LAGGARDS) && !(flags & SQ_FLAG_BROADCAST)) &&
+		!((flags & SQ_FLAG_OVERWRITE) && (flags & SQ_FLAG_BROADCAST)) && // see SQ_FLAG_EVICT_LAGGARDS instead
+		!(flags & SQ_FLAG_READONLY) &&
+		!((flags & SQ_FLAG_MIRROR) && (flags & (SQ_FLAG_HUGETLB|SQ_FLAG_HUGETLB_1GB))) && // mapped in 4KB pages
+		!(SQ_FLAG_NUMA_NODE(flags) && !(flags & SQ_FLAG_NUMA_BIND(0))) && // node given without bind
+		__builtin_popcount(flags & (SQ_FLAG_NUMA_INTERLEAVE|SQ_FLAG_NUMA_FIRST_TOUCH|SQ_FLAG_NUMA_BIND(0)))<=1;
+}
+
+// Same as sq_create(), with flags being a combination of SQ_FLAG_XXX
+struct sq_head_t *sq_create_ex(u64_t shm_key, int ele_size, int ele_count, int flags)
 {
 	struct sq_head_t *queue;
 
-	if(ele_size<=0 || ele_count<=0 || shm_key<=0) // invalid parameter
+	if(shm_key<=0 || !check_create_args(ele_size, ele_count, flags)) // invalid parameter
 	{
 		snprintf(errmsg, sizeof(errmsg), "Bad argument");
 		return NULL;
 	}
-	queue = open_shm_queue(shm_key, ele_size, ele_count, 1);
+	if(flags & SQ_FLAG_MIRROR) // refused before a SysV shm is created for nothing
+	{
+		snprintf(errmsg, sizeof(errmsg), "SQ_FLAG_MIRROR needs a POSIX shm, file or memfd queue");
+		return NULL;
+	}
+	errmsg[0] = 0;
+	queue = open_shm_queue(shm_key, -1, 0, ele_size, ele_count, flags, 1);
 	if(queue==NULL)
 	{
-		snprintf(errmsg, sizeof(errmsg), "Get shm failed");
+		if(!errmsg[0]) // not set by mlock etc.
+			snprintf(errmsg, sizeof(errmsg), "Get shm failed");
 		return NULL;
 	}
 	return queue;
@@ -343,181 +1028,2212 @@ struct sq_head_t *sq_create(u64_t shm_key, int ele_size, int ele_count)
 // Open an existing shm queue for reading data
 struct sq_head_t *sq_open(u64_t shm_key)
 {
-	struct sq_head_t *queue = open_shm_queue(shm_key, 0, 0, 0);
+	return sq_open_ex(shm_key, 0);
+}
+
+// Same as sq_open(), with flags being a combination of SQ_FLAG_PREFAULT/SQ_FLAG_MLOCK
+struct sq_head_t *sq_open_ex(u64_t shm_key, int flags)
+{
+	struct sq_head_t *queue;
+
+	if(flags & ~SQ_FLAGS_OPEN)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return NULL;
+	}
+	errmsg[0] = 0;
+	queue = open_shm_queue(shm_key, -1, 0, 0, 0, flags, 0);
 	if(queue==NULL)
 	{
-		snprintf(errmsg, sizeof(errmsg), "Open shm failed");
+		if(!errmsg[0]) // not set by mlock etc.
+			snprintf(errmsg, sizeof(errmsg), "Open shm failed");
 		return NULL;
 	}
 	return queue;
 }
 
-// Destroy TP created by sq_create()
-void sq_destroy(struct sq_head_t *queue)
+// Create or open a queue in file fd, which is new and empty if created is set
+// fd is not closed here, the mapping stays valid after it's closed
+static struct sq_head_t *open_fd_queue(int fd, int created, int ele_size, int ele_count, int flags, int create)
 {
-	shmdt(queue);
-	// do nothing for now
-}
+	struct sq_head_t *queue;
 
+	errmsg[0] = 0;
+	queue = open_shm_queue(0, fd, created, ele_size, ele_count, flags, create);
+	if(queue==NULL && !errmsg[0])
+		snprintf(errmsg, sizeof(errmsg), create? "Get shm failed" : "Open shm failed");
+	return queue;
+}
 
-// Add data to end of shm queue
-// Returns 0 on success or
-//     -1 - invalid parameter
-//     -2 - shm queue is full
-int sq_put(struct sq_head_t *queue, void *data, int datalen)
+// Open file path (or POSIX shm name if posix is set) with O_CREAT|O_EXCL first, so that only one creator initializes it
+// Returns the fd with *created set, or -1 if failed
+static int open_file(const char *path, int posix, int create, int readonly, int *created)
 {
-	u32_t idx;
-	struct sq_node_head_t *node;
-	int nr_nodes;
-	int new_tail;
+	int fd = -1;
+	int mode = readonly? O_RDONLY : O_RDWR;
 
-	if(queue==NULL || data==NULL || datalen<=0 || datalen>MAX_SQ_DATA_LENGTH)
+	*created = 0;
+	if(create)
 	{
-		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		fd = posix? shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0666) : open(path, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
+		if(fd>=0)
+			*created = 1;
+		else if(errno!=EEXIST)
+			goto failed;
+	}
+	if(fd<0)
+		fd = posix? shm_open(path, mode, 0666) : open(path, mode|O_CLOEXEC);
+	if(fd>=0)
+		return fd;
+failed:
+	snprintf(errmsg, sizeof(errmsg), "%s(%s): %s", posix? "shm_open" : "open", path, strerror(errno));
+	return -1;
+}
+
+// Same as open_fd_queue(), with the file opened/created from path
+static struct sq_head_t *open_path_queue(const char *path, int posix, int ele_size, int ele_count, int flags, int create)
+{
+	struct sq_head_t *queue;
+	int fd, created;
+
+	if(path==NULL || (create && !check_create_args(ele_size, ele_count, flags)) ||
+		(!create && (flags & ~SQ_FLAGS_OPEN)))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return NULL;
+	}
+	if((fd = open_file(path, posix, create, flags & SQ_FLAG_READONLY, &created))<0)
+		return NULL;
+	queue = open_fd_queue(fd, created, ele_size, ele_count, flags, create);
+	if(queue==NULL && created) // don't leave an uninitialized queue behind
+		posix? shm_unlink(path) : unlink(path);
+	close(fd);
+	return queue;
+}
+
+// Create/open a queue in POSIX shm name, e.g. "/my_queue"
+struct sq_head_t *sq_create_posix(const char *name, int ele_size, int ele_count, int flags)
+{
+	return open_path_queue(name, 1, ele_size, ele_count, flags, 1);
+}
+
+struct sq_head_t *sq_open_posix(const char *name, int flags)
+{
+	return open_path_queue(name, 1, 0, 0, flags, 0);
+}
+
+// Create/open a queue in regular file path, the data survive restarts of the system
+struct sq_head_t *sq_create_file(const char *path, int ele_size, int ele_count, int flags)
+{
+	return open_path_queue(path, 0, ele_size, ele_count, flags, 1);
+}
+
+struct sq_head_t *sq_open_file(const char *path, int flags)
+{
+	return open_path_queue(path, 0, 0, 0, flags, 0);
+}
+
+// Create a queue in an anonymous memfd, returned in *fd for passing to other processes
+struct sq_head_t *sq_create_memfd(const char *name, int ele_size, int ele_count, int flags, int *fd)
+{
+	static const unsigned int page_flags[] = {MFD_HUGETLB|MFD_HUGE_1GB, MFD_HUGETLB|MFD_HUGE_2MB, 0};
+	struct sq_head_t *queue;
+	int i;
+
+	if(name==NULL || fd==NULL || !check_create_args(ele_size, ele_count, flags))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return NULL;
+	}
+	// huge pages are reserved on mmap(), fall back to smaller pages if that fails
+	for(i = (flags & SQ_FLAG_HUGETLB_1GB)? 0 : (flags & SQ_FLAG_HUGETLB)? 1 : 2; i<3; i++)
+	{
+		if((*fd = memfd_create(name, MFD_CLOEXEC|page_flags[i]))<0)
+		{
+			snprintf(errmsg, sizeof(errmsg), "memfd_create: %s", strerror(errno));
+			continue;
+		}
+		if((queue = open_fd_queue(*fd, 1, ele_size, ele_count, flags, 1))!=NULL)
+			return queue;
+		close(*fd);
+		*fd = -1;
+		if(i<2)
+			printf("memfd with %s huge pages: %s, trying smaller pages\n", i? "2MB" : "1GB", sq_errorstr());
+	}
+	return NULL;
+}
+
+// Open a queue from fd returned by sq_create_memfd(), or any fd of a file holding a queue
+struct sq_head_t *sq_open_fd(int fd, int flags)
+{
+	if(fd<0 || (flags & ~SQ_FLAGS_OPEN))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return NULL;
+	}
+	return open_fd_queue(fd, 0, 0, 0, flags, 0);
+}
+
+// Pass fd to the process at the other end of UNIX socket sock
+// Returns 0 on success, -1 if failed
+int sq_send_fd(int sock, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = "q";
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	if(sendmsg(sock, &msg, 0)<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "sendmsg: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Receive an fd sent by sq_send_fd()
+// Returns the fd, or -1 if failed
+int sq_recv_fd(int sock)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char c;
+	int fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)<=0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "recvmsg: %s", errno? strerror(errno) : "closed");
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(cmsg==NULL || cmsg->cmsg_level!=SOL_SOCKET || cmsg->cmsg_type!=SCM_RIGHTS)
+	{
+		snprintf(errmsg, sizeof(errmsg), "No fd received");
+		return -1;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
+
+// Destroy TP created by sq_create()
+void sq_destroy(struct sq_head_t *queue)
+{
+	long size = remove_mapped_queue(queue);
+
+	// unmap what this process mapped, not the size in shm
+	detach_shm(queue, size>=0? SQ_BACKEND_MMAP : SQ_BACKEND_SYSV, size);
+	// do nothing for now
+}
+
+
+// Returns what the start_token of the node at pos is set to for token
+// With SQ_FLAG_SEQUENCE the token carries the low 29 bits of the position, so a token written in an earlier round
+// at the same index doesn't match, unless it was written 2^29 positions ago, see reset_interior()
+static inline u32_t sq_token(struct sq_head_t *queue, u64_t pos, u32_t token)
+{
+	return SQ_IS_SEQUENCE(queue)? ((u32_t)pos<<3) | (token & SQ_TOKEN_KIND_MASK) : token;
+}
+
+// Returns non-zero if the tokens of the nodes after the first one of consumed data must be reset
+// Those nodes keep whatever the data left there, a stale token written 2^29 positions ago or data that looks like one.
+// With a single producer, tail_pos is moved only after the token of the new data is stored, so readers never see them.
+// With several producers a reader may look at a node claimed before its PENDING token is stored, so they must be reset
+static inline int reset_interior(struct sq_head_t *queue)
+{
+	return !SQ_IS_SEQUENCE(queue) || SQ_IS_MULTI_PRODUCER(queue);
+}
+
+// Mark nr_nodes nodes from node as skipped, token is the PAD_TOKEN for the node
+static inline void write_pad(struct sq_node_head_t *node, int nr_nodes, u32_t token)
+{
+	node->datalen = nr_nodes;
+	BARRIER();
+	node->start_token = token;
+}
+
+// Find where nr_nodes continuous nodes go after tail
+// Returns the index of the first node, with *used set to the number of nodes taken from tail,
+// including the nodes skipped at the end when wrapping back to index 0
+// With SQ_FLAG_MIRROR the nodes run over the end into the second mapping, nothing is skipped
+static inline int place_nodes(struct sq_head_t *queue, u64_t tail, int nr_nodes, int *used)
+{
+	int idx;
+
+	// tail is the newest position, any writer may store it for the new hi, it's the same whoever wins
+	if(!SQ_IS_POW2(queue) && (u32_t)(tail>>32)>(u32_t)(queue->pos_lap>>32))
+		queue->pos_lap = (tail>>32<<32) | (u32_t)(tail>>32) % (u32_t)queue->ele_count;
+	idx = SQ_IDX(queue, tail);
+
+	if(idx+nr_nodes > queue->ele_count && !SQ_IS_MIRROR(queue)) // wrapped back  //如果出现反包
+	{
+		// We need a set of continuous nodes
+		// So skip the empty nodes at the end, and begin allocation at index 0
+		*used = queue->ele_count-idx+nr_nodes;
+		return 0;
+	}
+	*used = nr_nodes;
+	return idx;
+}
+
+// Returns the position of node idx, the first one at or after position base
+static inline u64_t idx_to_pos(struct sq_head_t *queue, u64_t base, int idx)
+{
+	int diff = idx-SQ_IDX(queue, base);
+
+	if(diff<0)
+		diff += queue->ele_count;
+	return base+diff;
+}
+
+// Returns the token for the node nr_nodes after node, which is claimed by this writer and not committed yet
+static inline u32_t claimed_token(struct sq_head_t *queue, struct sq_node_head_t *node, int nr_nodes, u32_t token)
+{
+	if(!SQ_IS_SEQUENCE(queue))
+		return token;
+	if(SQ_IS_MULTI_PRODUCER(queue)) // the position is in the PENDING token set by sq_reserve()
+		return ((node->start_token & ~SQ_TOKEN_KIND_MASK) + ((u32_t)nr_nodes<<3)) | (token & SQ_TOKEN_KIND_MASK);
+	// only this writer moves tail_pos, and the node was placed right after it
+	return sq_token(queue, idx_to_pos(queue, queue->tail_pos, SQ_NODE_IDX(queue, node))+nr_nodes, token);
+}
+
+// Update the copy of the other side's position kept on our side's cache line
+// The copy only moves forward, so a position checked against it is never overtaken
+// Returns the position just read
+static inline u64_t refresh_pos(volatile u64_t *cached, volatile u64_t *pos)
+{
+	u64_t old, val;
+
+	do
+	{
+		old = *cached;
+		val = *pos; // read after the copy, it's never older
+	} while(old!=val && !CAS64(cached, old, val));
+	return val;
+}
+
+// Returns the position of the slowest subscriber of a broadcast queue, the writer must not go beyond it
+// Subscribers behind want are in the way: dead ones are dropped, and with SQ_FLAG_EVICT_LAGGARDS,
+// the others are evicted so that their data can be overwritten
+static u64_t subscribers_free_pos(struct sq_head_t *queue, u64_t want)
+{
+	struct sq_cursor_t *cursor;
+	u64_t free_pos = queue->tail_pos, pos;
+	pid_t pid;
+	int i;
+
+	for(i=0; i<MAX_SUBSCRIBER_NUM; i++)
+	{
+		cursor = queue->cursors+i;
+		if((pid = cursor->pid)==0 || cursor->evicted)
+			continue;
+		pos = cursor->pos;
+		if(pos<want)
+		{
+			if(!is_pid_valid(pid))
+			{
+				CAS32(&cursor->pid, pid, 0);
+				continue;
+			}
+			if(queue->flags & SQ_FLAG_EVICT_LAGGARDS)
+			{
+				cursor->evicted = 1;
+				continue;
+			}
+		}
+		if(pos<free_pos)
+			free_pos = pos;
+	}
+	__sync_synchronize(); // evicted must be visible before the data is overwritten
+	return free_pos;
+}
+
+// with the readers' functions below
+static int reclaim_node(struct sq_head_t *queue);
+static int make_room(struct sq_head_t *queue, u64_t free_pos, u64_t old_tail, u64_t pos, int *waits);
+
+// The queue looks full, see how far the readers have got for used more nodes after old_tail
+static inline void refresh_free_pos(struct sq_head_t *queue, u64_t old_tail, int used)
+{
+	// only one writer, which keeps free_pos by itself, and head_pos for sq_get_usage()
+	if(SQ_IS_BROADCAST(queue))
+		queue->head_pos = queue->free_pos = queue->cached_free_pos = subscribers_free_pos(queue, old_tail+used-queue->ele_count);
+	else
+	{
+		while(reclaim_node(queue));
+		refresh_pos(&queue->cached_free_pos, &queue->free_pos);
+	}
+}
+
+// In multi-producer mode no one else claims nodes while a thread is putting large data, so that its chunks stay together
+// Returns non-zero if a thread other than stream (the caller's tid if it's putting large data, or 0) is doing that
+static int stream_busy(struct sq_head_t *queue, pid_t stream)
+{
+	pid_t writer = queue->stream_writer;
+
+	if(writer==0 || writer==stream)
+		return 0;
+	if(is_pid_valid(writer))
+		return 1;
+	CAS32(&queue->stream_writer, writer, 0); // died in the middle, the readers skip what it has put
+	return 0;
+}
+
+// Find nr_nodes continuous empty nodes after tail
+// In multi-producer mode the nodes are claimed here by advancing tail_pos with CAS,
+// otherwise the caller publishes new_tail after the data is written
+// stream is the tid of the caller putting large data, or 0, see stream_busy()
+// Returns the index of the first node, -2 if there are not enough empty nodes,
+// or -3 if another thread is putting large data
+static int claim_nodes(struct sq_head_t *queue, int nr_nodes, u64_t *new_tail, pid_t stream)
+{
+	u64_t free_pos, old_tail;
+	int idx, used;
+	int refreshed = 0, waits = 0;
+
+	while(1)
+	{
+		free_pos = queue->cached_free_pos; // nodes read but not released yet are not empty
+		old_tail = queue->tail_pos;
+		idx = place_nodes(queue, old_tail, nr_nodes, &used);
+		if(SQ_EMPTY_NODES3(queue, free_pos, old_tail)<used)
+		{
+			if(refreshed && SQ_IS_OVERWRITE(queue) && make_room(queue, free_pos, old_tail, old_tail+used-queue->ele_count, &waits))
+				continue;
+			if(refreshed)
+				return -2; // not enough empty nodes
+			refresh_free_pos(queue, old_tail, used);
+			refreshed = 1;
+			continue;
+		}
+		*new_tail = old_tail+used;
+		if(!SQ_IS_MULTI_PRODUCER(queue) || CAS64(&queue->tail_pos, old_tail, *new_tail))
+			break;
+	}
+
+	// checked after the CAS, so either the nodes are before the first chunk, or we see its writer here
+	if(SQ_IS_MULTI_PRODUCER(queue) && queue->stream_writer!=stream && stream_busy(queue, stream))
+	{
+		write_pad(SQ_GET(queue, SQ_IDX(queue, old_tail)), used, sq_token(queue, old_tail, PAD_TOKEN));
+		return -3;
+	}
+	if(used!=nr_nodes) // let the readers jump to index 0 directly
+		write_pad(SQ_GET(queue, SQ_IDX(queue, old_tail)), used-nr_nodes, sq_token(queue, old_tail, PAD_TOKEN));
+	return idx;
+}
+
+// Returns non-zero if any reader turned on signaling
+static inline int sigmask_any(struct sq_head_t *queue)
+{
+	u32_t i;
+	for(i=0; i<sizeof(queue->sigmask); i++)
+		if(queue->sigmask[i])
+			return 1;
+	return 0;
+}
+
+// Signal the readers waiting on queue after new data is committed
+static void signal_readers(struct sq_head_t *queue)
+{
+	// the new data must be visible before data_waiters is checked, pairs with sq_timedwait()
+	// publishing the data itself only needs a compiler barrier, but this is a store followed
+	// by a load, which even x86 reorders, so keep the full fence, once per put or batch
+	__sync_synchronize();
+
+	if(queue->data_waiters && // wake up the readers blocked in sq_wait()
+		SQ_USED_NODES(queue)>=queue->sig_node_num) // element num reached
+	{
+		__sync_fetch_and_add(&queue->data_futex, 1);
+		syscall(SYS_futex, &queue->data_futex, FUTEX_WAKE, queue->sig_process_num>0? queue->sig_process_num : INT_MAX, NULL, NULL, 0);
+		SQ_STAT_ADD(queue, signals, 1);
+	}
+	if(sigmask_any(queue) && // someone is waiting for signal/fd notification
+		SQ_USED_NODES(queue)>=queue->sig_node_num) // element num reached
+	{
+		int i, nr;
+		// signal at most queue->sig_process_num processes
+		for(i=0,nr=0; i<(int)queue->pidnum && nr<queue->sig_process_num; i++) //分别给不同的进程发信号
+		{
+			if(queue->pidset[i] && queue->sigmask[i/8] & 1<<(i%8) &&
+				(queue->data_signum || queue->fdmask[i/8] & 1<<(i%8)))
+			{
+				// avoids being signaled again, turn it off before signaling, so that the
+				// reader turning it on again right after being waken up is not missed
+				if(!(__sync_fetch_and_and(queue->sigmask+(i/8), (uint8_t)~(1U<<(i%8))) & 1<<(i%8)))
+					continue;
+				if(queue->fdmask[i/8] & 1<<(i%8))
+					notify_fd(queue, i);
+				else
+					kill((pid_t)queue->pidset[i], queue->data_signum);
+				nr ++;
+			}
+		}
+		if(nr)
+			SQ_STAT_ADD(queue, signals, nr);
+	}
+}
+
+// Set the time node is put
+static inline void stamp_node(struct sq_head_t *queue, struct sq_node_head_t *node)
+{
+	struct timeval now;
+
+	if(!SQ_HAS_TIMESTAMP(queue))
+	{
+		return;
+	}
+	else if(SQ_HAS_CLOCK_NS(queue))
+	{
+		node->enqueue_ns = opt_clock_ns();
+	}
+	else
+	{
+		opt_gettimeofday(&now, NULL);  //插入节点时候的时间
+		node->enqueue_time = now;
+	}
+}
+
+// Returns the nanoseconds node has been in queue, 0 if not known
+static inline long long node_age_ns(struct sq_head_t *queue, struct sq_node_head_t *node)
+{
+	struct timeval now, tv;
+	long long ns;
+
+	if(!SQ_HAS_TIMESTAMP(queue))
+		return 0;
+	if(SQ_HAS_CLOCK_NS(queue))
+	{
+		ns = (long long)(opt_clock_ns()-node->enqueue_ns);
+	}
+	else
+	{
+		opt_gettimeofday(&now, NULL);
+		tv = node->enqueue_time;
+		ns = (now.tv_sec-tv.tv_sec)*1000000000LL + (now.tv_usec-tv.tv_usec)*1000LL;
+	}
+	return ns>0? ns : 0; // clock stepped back
+}
+
+// Returns the time now in the clock of the node timestamps of queue, in ns
+static inline u64_t stamp_clock_ns(struct sq_head_t *queue)
+{
+	struct timeval now;
+
+	if(SQ_HAS_CLOCK_NS(queue))
+		return opt_clock_ns();
+	opt_gettimeofday(&now, NULL);
+	return now.tv_sec*1000000000ULL + now.tv_usec*1000ULL;
+}
+
+// Returns non-zero if the data of node are older than the TTL of queue
+// *now is the time from stamp_clock_ns(), read on the first call with *now==0
+static inline int data_expired(struct sq_head_t *queue, struct sq_node_head_t *node, u64_t *now)
+{
+	u64_t stamp;
+
+	if(*now==0)
+		*now = stamp_clock_ns(queue);
+	stamp = SQ_HAS_CLOCK_NS(queue)? node->enqueue_ns : node->enqueue_time.tv_sec*1000000000ULL + node->enqueue_time.tv_usec*1000ULL;
+	return (long long)(*now-stamp) > queue->ttl_ns;
+}
+
+// Set the time to live of the data in queue, 0 for no TTL
+// Returns 0 on success, -1 if parameter is bad
+int sq_set_ttl(struct sq_head_t *queue, int ttl_ms)
+{
+	if(queue==NULL || ttl_ms<0 || !SQ_HAS_TIMESTAMP(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	queue->ttl_ns = ttl_ms*1000000LL;
+	return 0;
+}
+
+// Get the time node was put, as gettimeofday() would have returned, or 0 if the queue has no timestamp
+static inline void get_enqueue_time(struct sq_head_t *queue, struct sq_node_head_t *node, struct timeval *tv)
+{
+	long long ns;
+
+	if(!SQ_HAS_TIMESTAMP(queue))
+	{
+		tv->tv_sec = tv->tv_usec = 0;
+	}
+	else if(SQ_HAS_CLOCK_NS(queue))
+	{
+		ns = node_age_ns(queue, node);
+		opt_gettimeofday(tv, NULL);
+		ns = tv->tv_sec*1000000000LL + tv->tv_usec*1000LL - ns;
+		tv->tv_sec = ns/1000000000LL;
+		tv->tv_usec = ns%1000000000LL/1000;
+	}
+	else
+	{
+		*tv = node->enqueue_time;
+	}
+}
+
+// Convert a data pointer returned by sq_reserve() back to its node, NULL if it's not one of ours
+static struct sq_node_head_t *data_to_node(struct sq_head_t *queue, void *data)
+{
+	struct sq_node_head_t *node = (struct sq_node_head_t *)((char*)data - queue->head_size);
+	int idx;
+
+	if((char*)node<(char*)queue->nodes)
+		return NULL;
+	idx = SQ_NODE_IDX(queue, node);
+	if(idx>=queue->ele_count || SQ_GET(queue, idx)!=node)
+		return NULL;
+	return node;
+}
+
+// sq_reserve() for the data or a chunk of large data put by thread stream, see claim_nodes()
+static int reserve_node(struct sq_head_t *queue, int datalen, void **data, pid_t stream)
+{
+	struct sq_node_head_t *node;
+	int nr_nodes, idx;
+	u64_t new_tail;
+
+	if(queue==NULL || data==NULL || datalen<=0 || datalen>MAX_SQ_DATA_LENGTH)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+
+	// calculate the number of nodes needed   计算数据需要多少块
+	nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
+
+	idx = claim_nodes(queue, nr_nodes, &new_tail, stream);
+	if(idx<0)
+	{
+		SQ_STAT_ADD(queue, full, 1);
+		if(idx==-3)
+			snprintf(errmsg, sizeof(errmsg), "Large data being put by another thread");
+		else
+			snprintf(errmsg, sizeof(errmsg), "Not enough for new data");
+		return -2;
+	}
+	node = SQ_GET(queue, idx);
+	node->datalen = datalen; // remembered for sq_commit()/sq_abort()
+	if(SQ_IS_MULTI_PRODUCER(queue))
+	{
+		// readers may see the node from now on, tell them it's being written
+		BARRIER();
+		node->start_token = sq_token(queue, new_tail-nr_nodes, PENDING_TOKEN);
+	}
+	*data = SQ_NODE_DATA(queue, node);
+	return 0;
+}
+
+// Reserve space for datalen bytes at the end of queue, so that data can be written into shm directly
+// Returns 0 on success with *data pointing to the reserved space, or
+//     -1 - invalid parameter
+//     -2 - shm queue is full
+int sq_reserve(struct sq_head_t *queue, int datalen, void **data)
+{
+	return reserve_node(queue, datalen, data, 0);
+}
+
+// Put nr_nodes nodes from the one at offset after node, reserved but not used, back into the queue
+// In single producer mode, tail_pos is not published yet and nothing needs to be done,
+// otherwise the nodes already claimed are padded so that the readers can skip them
+static void pad_nodes(struct sq_head_t *queue, struct sq_node_head_t *node, int offset, int nr_nodes)
+{
+	if(nr_nodes>0 && SQ_IS_MULTI_PRODUCER(queue))
+		write_pad(SQ_GET(queue, SQ_NODE_IDX(queue, node)+offset), nr_nodes, claimed_token(queue, node, offset, PAD_TOKEN));
+}
+
+// Call the watermark callback of queue in this process, if the used nodes crossed a watermark since last time
+static void check_watermarks(struct sq_head_t *queue)
+{
+	int i, used;
+
+	for(i=0; i<nr_watermark_cbs && watermark_cbs[i].queue!=queue; i++);
+	if(i==nr_watermark_cbs)
+		return;
+	// the copy of free_pos is never ahead of it, so the nodes used are never under-estimated here
+	used = (int)(queue->tail_pos-queue->cached_free_pos);
+	if(!watermark_cbs[i].above && used<queue->watermark_high)
+		return;
+	// the writer of a broadcast queue keeps free_pos by itself
+	if(!SQ_IS_BROADCAST(queue))
+		used = (int)(queue->tail_pos-refresh_pos(&queue->cached_free_pos, &queue->free_pos));
+	if(!watermark_cbs[i].above)
+	{
+		if(used>=queue->watermark_high && CAS32(&watermark_cbs[i].above, 0, 1))
+			watermark_cbs[i].fn(queue, used, 1, watermark_cbs[i].arg);
+	}
+	else if(used<=queue->watermark_low && CAS32(&watermark_cbs[i].above, 1, 0))
+	{
+		watermark_cbs[i].fn(queue, used, 0, watermark_cbs[i].arg);
+	}
+}
+
+// Set the watermarks of queue, and the callback of this process for crossing them
+// Returns 0 on success, -1 if parameter is bad or too many queues have callbacks
+int sq_set_watermarks(struct sq_head_t *queue, int high, int low, sq_watermark_fn fn, void *arg)
+{
+	int i;
+
+	if(queue==NULL || low<0 || low>=high || high>queue->ele_count)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	for(i=0; i<nr_watermark_cbs && watermark_cbs[i].queue!=queue; i++);
+	if(fn && i==MAX_WATERMARK_QUEUES)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Too many queues with watermark callbacks");
+		return -1;
+	}
+	queue->watermark_high = high;
+	queue->watermark_low = low;
+	if(fn==NULL)
+	{
+		if(i<nr_watermark_cbs) // removed by moving the last one here
+			watermark_cbs[i] = watermark_cbs[--nr_watermark_cbs];
+		return 0;
+	}
+	watermark_cbs[i].queue = queue;
+	watermark_cbs[i].fn = fn;
+	watermark_cbs[i].arg = arg;
+	watermark_cbs[i].above = 0;
+	if(i==nr_watermark_cbs)
+		nr_watermark_cbs ++;
+	return 0;
+}
+
+// Commit datalen bytes of the reserved node, as data or a chunk by token
+static int commit_node(struct sq_head_t *queue, struct sq_node_head_t *node, int datalen, u32_t token)
+{
+	int nr_nodes, nr_reserved;
+	int idx;
+
+	idx = SQ_NODE_IDX(queue, node);
+	nr_reserved = SQ_NUM_NEEDED_NODES(queue, node->datalen);
+	nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
+	pad_nodes(queue, node, nr_nodes, nr_reserved-nr_nodes);
+
+	// initialize the new node
+	token = claimed_token(queue, node, 0, token);
+	node->datalen = datalen;
+	stamp_node(queue, node);
+	BARRIER(); // data must be visible before the node is committed
+	node->start_token = token;
+	if(!SQ_IS_MULTI_PRODUCER(queue))
+	{
+		BARRIER();
+		// only this writer moves tail_pos, and the node was placed right after it
+		queue->tail_pos = idx_to_pos(queue, queue->tail_pos, idx)+nr_nodes;
+	}
+	SQ_STAT_ADD(queue, puts, 1);
+	SQ_STAT_ADD(queue, put_bytes, datalen);
+	if(nr_watermark_cbs)
+		check_watermarks(queue);
+
+	// now signal the reader wait on queue
+	signal_readers(queue);
+	return 0;
+}
+
+// Commit the data written to the space returned by sq_reserve()
+// datalen can be less than the reserved length
+// Returns 0 on success, -1 if parameter is bad
+int sq_commit(struct sq_head_t *queue, void *data, int datalen)
+{
+	struct sq_node_head_t *node;
+
+	if(queue==NULL || (node = data_to_node(queue, data))==NULL || datalen<=0 || (u32_t)datalen>node->datalen)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	return commit_node(queue, node, datalen, START_TOKEN);
+}
+
+// Give up the space returned by sq_reserve()
+// Returns 0 on success, -1 if parameter is bad
+int sq_abort(struct sq_head_t *queue, void *data)
+{
+	struct sq_node_head_t *node;
+
+	if(queue==NULL || (node = data_to_node(queue, data))==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	pad_nodes(queue, node, 0, SQ_NUM_NEEDED_NODES(queue, node->datalen));
+	return 0;
+}
+
+// Returns the NUMA node holding most of the data pages of queue, or -1 if not known
+int sq_get_node(struct sq_head_t *queue)
+{
+	void *pages[16];
+	int status[16], count[16], nodes[16];
+	long size, page_size = getpagesize();
+	int i, j, n, best;
+
+	if(queue==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	// sample pages all over the data, without faulting them in
+	size = (long)SQ_NODE_SIZE(queue)*queue->ele_count;
+	n = size/page_size<16? (int)(size/page_size)+1 : 16;
+	for(i=0; i<n; i++)
+		pages[i] = (void*)(((unsigned long)queue->nodes + size/n*i) & ~(page_size-1));
+	if(syscall(SYS_move_pages, 0, n, pages, NULL, status, 0)<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "move_pages: %s", strerror(errno));
+		return -1;
+	}
+	for(i=0, j=0; i<n; i++) // count the pages on each node
+	{
+		if(status[i]<0) // not allocated yet
+			continue;
+		for(best=0; best<j && nodes[best]!=status[i]; best++);
+		if(best==j)
+		{
+			nodes[j] = status[i];
+			count[j++] = 0;
+		}
+		count[best] ++;
+	}
+	if(j==0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Pages not allocated yet");
+		return -1;
+	}
+	for(i=1, best=0; i<j; i++)
+		if(count[i]>count[best])
+			best = i;
+	return nodes[best];
+}
+
+// Add data to end of shm queue
+// Returns 0 on success or
+//     -1 - invalid parameter
+//     -2 - shm queue is full
+int sq_put(struct sq_head_t *queue, void *data, int datalen)
+{
+	void *buf;
+	int ret;
+
+	if(data==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	ret = sq_reserve(queue, datalen, &buf);
+	if(ret<0)
+		return ret;
+	memcpy(buf, data, datalen);
+	return sq_commit(queue, buf, datalen);
+}
+
+// Set *deadline to timeout_ms milliseconds from now, in CLOCK_MONOTONIC
+static void get_deadline(int timeout_ms, struct timespec *deadline)
+{
+	clock_gettime(CLOCK_MONOTONIC, deadline);
+	deadline->tv_sec += timeout_ms/1000;
+	deadline->tv_nsec += (timeout_ms%1000)*1000000L;
+	if(deadline->tv_nsec>=1000000000L)
+	{
+		deadline->tv_sec ++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+}
+
+// Set *ts to the time left until deadline
+// Returns 0, or -1 if deadline has passed
+static int time_left(const struct timespec *deadline, struct timespec *ts)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ts->tv_sec = deadline->tv_sec - now.tv_sec;
+	ts->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if(ts->tv_nsec<0)
+	{
+		ts->tv_sec --;
+		ts->tv_nsec += 1000000000L;
+	}
+	return ts->tv_sec<0? -1 : 0;
+}
+
+// Put a chunk of large data, made of its chunk head and len bytes of data
+// Returns as sq_put()
+static int put_chunk(struct sq_head_t *queue, const struct sq_chunk_head_t *chunk, const void *data, int len)
+{
+	void *buf;
+	int ret;
+
+	ret = reserve_node(queue, sizeof(*chunk)+len, &buf, chunk->writer);
+	if(ret<0)
+		return ret;
+	memcpy(buf, chunk, sizeof(*chunk));
+	memcpy((char*)buf+sizeof(*chunk), data, len);
+	return commit_node(queue, data_to_node(queue, buf), sizeof(*chunk)+len, CHUNK_TOKEN);
+}
+
+// Put data, or a chunk of large data if chunk is not NULL, waiting for the readers to free nodes until deadline (forever if NULL)
+// Returns 0 on success, -1 if parameter is bad, -2 if still full on timeout or interrupted by a signal
+static int put_wait(struct sq_head_t *queue, const struct sq_chunk_head_t *chunk, const void *data, int datalen, const struct timespec *deadline)
+{
+	struct timespec ts;
+	u32_t seq;
+	int ret;
+
+	// a locked add is a full barrier, the readers either see us waiting or we see the nodes they freed
+	__sync_fetch_and_add(&queue->space_waiters, 1);
+	while(1)
+	{
+		seq = queue->space_futex;
+		if((ret = chunk? put_chunk(queue, chunk, data, datalen) : sq_put(queue, (void*)data, datalen))!=-2)
+			break;
+		if(deadline && time_left(deadline, &ts)<0)
+			break;
+		if(SQ_IS_BROADCAST(queue) && (deadline==NULL || ts.tv_sec>0 || ts.tv_nsec>SQ_BROADCAST_WAIT_MS*1000000L))
+		{
+			ts.tv_sec = 0;
+			ts.tv_nsec = SQ_BROADCAST_WAIT_MS*1000000L;
+		}
+		if(syscall(SYS_futex, &queue->space_futex, FUTEX_WAIT, seq,
+			(deadline || SQ_IS_BROADCAST(queue))? &ts : NULL, NULL, 0)<0 && errno==EINTR)
+			break;
+	}
+	__sync_fetch_and_sub(&queue->space_waiters, 1);
+	return ret;
+}
+
+// Same as sq_put(), but wait up to timeout_ms milliseconds (forever if timeout_ms<0) for the readers to free nodes
+// Returns 0 on success, -1 if parameter is bad, -2 if still full on timeout or interrupted by a signal
+int sq_put_wait(struct sq_head_t *queue, void *data, int datalen, int timeout_ms)
+{
+	struct timespec deadline;
+	int ret;
+
+	if((ret = sq_put(queue, data, datalen))!=-2)
+		return ret;
+	if(SQ_NUM_NEEDED_NODES(queue, datalen)>queue->ele_count) // never fits
+	{
+		snprintf(errmsg, sizeof(errmsg), "Data length(%d) exceeds queue size", datalen);
+		return -1;
+	}
+	if(timeout_ms>=0)
+		get_deadline(timeout_ms, &deadline);
+	return put_wait(queue, NULL, data, datalen, timeout_ms>=0? &deadline : NULL);
+}
+
+// Returns the most bytes of large data put in a chunk, up to a quarter of queue so that the writer and readers overlap
+static inline int chunk_size(struct sq_head_t *queue)
+{
+	long size = (long)SQ_NODE_SIZE(queue)*(queue->ele_count/4) - queue->head_size;
+
+	return (int)(size<MAX_SQ_DATA_LENGTH? size : MAX_SQ_DATA_LENGTH) - (int)sizeof(struct sq_chunk_head_t);
+}
+
+// Put datalen bytes of data of any length, split into chunks if needed
+// Returns 0 on success, -1 if parameter is bad, -2 if still full on timeout or interrupted by a signal
+int sq_put_large(struct sq_head_t *queue, const void *data, int datalen, int timeout_ms)
+{
+	struct sq_chunk_head_t chunk;
+	struct timespec deadline, ts;
+	pid_t writer;
+	int max_len, len, ret = 0;
+
+	if(queue==NULL || data==NULL || datalen<=0 || SQ_IS_BROADCAST(queue) || (max_len = chunk_size(queue))<=0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(datalen<=max_len+(int)sizeof(chunk)) // put as usual, so that sq_get() can read it too
+		return sq_put_wait(queue, (void*)data, datalen, timeout_ms);
+
+	if(timeout_ms>=0)
+		get_deadline(timeout_ms, &deadline);
+	// one large data at a time, the readers see its chunks one after another
+	chunk.writer = syscall(SYS_gettid);
+	while(!CAS32(&queue->stream_writer, 0, chunk.writer))
+	{
+		if((writer = queue->stream_writer) && !is_pid_valid(writer))
+		{
+			CAS32(&queue->stream_writer, writer, 0);
+			continue;
+		}
+		if(timeout_ms>=0 && time_left(&deadline, &ts)<0)
+		{
+			snprintf(errmsg, sizeof(errmsg), "Large data being put by another thread");
+			return -2;
+		}
+		usleep(1000);
+	}
+
+	chunk.total = datalen;
+	chunk.reserved = 0;
+	for(chunk.offset=0; chunk.offset<(u32_t)datalen; chunk.offset+=len)
+	{
+		len = (u32_t)datalen-chunk.offset<(u32_t)max_len? (int)((u32_t)datalen-chunk.offset) : max_len;
+		if((ret = put_wait(queue, &chunk, (const char*)data+chunk.offset, len, timeout_ms>=0? &deadline : NULL))<0)
+			break; // the readers drop the chunks already put
+	}
+
+	// after the last chunk is committed, a reader waiting for more sees we're done
+	queue->stream_writer = 0;
+	__sync_synchronize();
+	if(SQ_IS_MULTI_PRODUCER(queue) && queue->space_waiters) // the other writers may put again
+	{
+		__sync_fetch_and_add(&queue->space_futex, 1);
+		syscall(SYS_futex, &queue->space_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+	return ret;
+}
+
+// Add several data to end of shm queue at once
+// tail_pos is published and the readers are signaled only once for all the data
+// Returns the number of data added, which is less than count if the queue is full, or
+//     -1 - invalid parameter
+int sq_put_batch(struct sq_head_t *queue, const struct iovec *iov, int count)
+{
+	struct sq_node_head_t *node;
+	struct timeval now;
+	u64_t now_ns = 0;
+	int i, n, nr_nodes;
+	u64_t free_pos, old_tail, tail;
+	int idx, used, empty;
+	int refreshed, waits = 0;
+	long bytes;
+
+	if(queue==NULL || iov==NULL || count<0)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	for(i=0; i<count; i++)
+	{
+		if(iov[i].iov_base==NULL || iov[i].iov_len<=0 || iov[i].iov_len>MAX_SQ_DATA_LENGTH)
+		{
+			snprintf(errmsg, sizeof(errmsg), "Bad argument");
+			return -1;
+		}
+	}
+
+	// find out how many data can be put, and claim all the nodes at once
+	refreshed = 0;
+	while(1)
+	{
+		free_pos = queue->cached_free_pos;
+		tail = old_tail = queue->tail_pos;
+		empty = SQ_EMPTY_NODES3(queue, free_pos, old_tail);
+		for(n=0; n<count; n++)
+		{
+			place_nodes(queue, tail, SQ_NUM_NEEDED_NODES(queue, iov[n].iov_len), &used);
+			if(used>empty)
+				break;
+			empty -= used;
+			tail += used;
+		}
+		if(n<count && (!refreshed || SQ_IS_OVERWRITE(queue))) // looks full, see how far the readers have got
+		{
+			for(i=n, used=(int)(tail-old_tail); i<count; i++)
+				used += SQ_NUM_NEEDED_NODES(queue, iov[i].iov_len);
+			if(!refreshed)
+				refresh_free_pos(queue, old_tail, used);
+			else if(!make_room(queue, free_pos, old_tail, old_tail+used-queue->ele_count, &waits)) // nothing more can be dropped
+				goto placed;
+			refreshed = 1;
+			continue;
+		}
+placed:
+		if(n==0)
+		{
+			SQ_STAT_ADD(queue, full, 1);
+			snprintf(errmsg, sizeof(errmsg), "Not enough for new data");
+			return 0;
+		}
+		if(!SQ_IS_MULTI_PRODUCER(queue) || CAS64(&queue->tail_pos, old_tail, tail))
+			break;
+	}
+	if(SQ_IS_MULTI_PRODUCER(queue) && queue->stream_writer && stream_busy(queue, 0)) // see claim_nodes()
+	{
+		write_pad(SQ_GET(queue, SQ_IDX(queue, old_tail)), (int)(tail-old_tail), sq_token(queue, old_tail, PAD_TOKEN));
+		SQ_STAT_ADD(queue, full, 1);
+		snprintf(errmsg, sizeof(errmsg), "Large data being put by another thread");
+		return 0;
+	}
+
+	// all the data of a batch are put at the same time
+	if(SQ_HAS_CLOCK_NS(queue))
+		now_ns = opt_clock_ns();
+	else
+		opt_gettimeofday(&now, NULL);
+	for(i=0, tail=old_tail, bytes=0; i<n; i++)
+	{
+		nr_nodes = SQ_NUM_NEEDED_NODES(queue, iov[i].iov_len);
+		idx = place_nodes(queue, tail, nr_nodes, &used);
+		if(used!=nr_nodes)
+			write_pad(SQ_GET(queue, SQ_IDX(queue, tail)), used-nr_nodes, sq_token(queue, tail, PAD_TOKEN));
+		tail += used; // the data are at the end of the nodes used
+
+		node = SQ_GET(queue, idx);
+		node->datalen = iov[i].iov_len;
+		if(SQ_HAS_CLOCK_NS(queue))
+			node->enqueue_ns = now_ns;
+		else if(SQ_HAS_TIMESTAMP(queue))
+			node->enqueue_time = now;
+		if(SQ_IS_MULTI_PRODUCER(queue))
+		{
+			BARRIER();
+			node->start_token = sq_token(queue, tail-nr_nodes, PENDING_TOKEN);
+		}
+		memcpy(SQ_NODE_DATA(queue, node), iov[i].iov_base, iov[i].iov_len);
+		BARRIER();
+		node->start_token = sq_token(queue, tail-nr_nodes, START_TOKEN);
+		bytes += iov[i].iov_len;
+	}
+	if(!SQ_IS_MULTI_PRODUCER(queue))
+	{
+		BARRIER();
+		queue->tail_pos = tail;
+	}
+	SQ_STAT_ADD(queue, puts, n);
+	SQ_STAT_ADD(queue, put_bytes, bytes);
+	if(nr_watermark_cbs)
+		check_watermarks(queue);
+	if(n<count)
+		SQ_STAT_ADD(queue, full, 1);
+
+	signal_readers(queue);
+	return n;
+}
+
+int sq_get_usage(struct sq_head_t *queue)
+{
+	return queue->ele_count? ((SQ_USED_NODES(queue))*100)/queue->ele_count : 0;
+}
+
+int sq_get_used_blocks(struct sq_head_t *queue)
+{
+	return SQ_USED_NODES(queue);
+}
+
+// Sum up the counters of all the shards
+// Returns 0 on success, -1 if parameter is bad
+int sq_get_stat(struct sq_head_t *queue, struct sq_stat_t *stat)
+{
+	struct sq_counters_t *c;
+	int i;
+
+	if(queue==NULL || stat==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	memset(stat, 0, sizeof(*stat));
+	for(i=0; i<SQ_STAT_SHARDS; i++)
+	{
+		c = queue->counters+i;
+		stat->puts += c->puts;
+		stat->put_bytes += c->put_bytes;
+		stat->gets += c->gets;
+		stat->get_bytes += c->get_bytes;
+		stat->full += c->full;
+		stat->cas_retries += c->cas_retries;
+		stat->corrupted += c->corrupted;
+		stat->signals += c->signals;
+		stat->dropped += c->dropped;
+		stat->expired += c->expired;
+	}
+	stat->high_water = queue->high_water;
+	stat->used_nodes = SQ_USED_NODES(queue);
+	stat->ele_count = queue->ele_count;
+	stat->ele_size = queue->ele_size;
+	stat->flags = queue->flags;
+	return 0;
+}
+
+// Sum up the latency histograms of all the shards
+// Returns 0 on success, -1 if parameter is bad or the queue has no histogram
+int sq_get_latency(struct sq_head_t *queue, struct sq_latency_t *lat)
+{
+	struct sq_latency_hist_t *hist;
+	int i, j;
+
+	if(queue==NULL || lat==NULL || !SQ_HAS_LATENCY(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	memset(lat, 0, sizeof(*lat));
+	for(i=0; i<SQ_LATENCY_SHARDS; i++)
+	{
+		hist = queue->latency+i;
+		lat->count += hist->count;
+		lat->total_ns += hist->total_ns;
+		if(hist->max_ns>lat->max_ns)
+			lat->max_ns = hist->max_ns;
+		for(j=0; j<SQ_LATENCY_BUCKETS; j++)
+			lat->buckets[j] += hist->buckets[j];
+	}
+	return 0;
+}
+
+u64_t sq_latency_percentile(const struct sq_latency_t *lat, double percent)
+{
+	u64_t total = 0, n = 0, want;
+	int i;
+
+	// count is summed up separately from the buckets, it can be a little off while data are being read
+	for(i=0; i<SQ_LATENCY_BUCKETS; i++)
+		total += lat->buckets[i];
+	if(total==0)
+		return 0;
+	want = (u64_t)(total*percent/100.0 + 0.5);
+	if(want<1)
+		want = 1;
+	for(i=0; i<SQ_LATENCY_BUCKETS; i++)
+	{
+		n += lat->buckets[i];
+		if(n>=want)
+			return sq_latency_value(i);
+	}
+	return sq_latency_value(SQ_LATENCY_BUCKETS-1);
+}
+
+// Returns non-zero if node at pos looks claimed by a producer but not committed yet, in multi-producer mode
+// With SQ_FLAG_SEQUENCE that is anything but the data or pad of this round, a corrupted node included
+static inline int node_pending(struct sq_head_t *queue, u64_t pos, struct sq_node_head_t *node)
+{
+	u32_t token = node->start_token;
+
+	if(SQ_IS_SEQUENCE(queue))
+		return token!=sq_token(queue, pos, START_TOKEN) && token!=sq_token(queue, pos, PAD_TOKEN) && token!=sq_token(queue, pos, CHUNK_TOKEN);
+	return token==0 || token==PENDING_TOKEN;
+}
+
+// In multi-producer mode, a node between head and tail may have been claimed but not committed yet
+// Returns 1 if readers should wait for the node at pos, or 0 if it can be handled as usual
+static int wait_for_commit(struct sq_head_t *queue, u64_t pos, struct sq_node_head_t *node)
+{
+	u64_t mark, now;
+	u32_t key = (u32_t)(pos+1)? (u32_t)(pos+1) : 1; // 0 means no one is waiting
+
+	if(!SQ_IS_MULTI_PRODUCER(queue) || !node_pending(queue, pos, node))
+		return 0;
+
+	// a producer dying before committing would block the readers forever,
+	// so give up waiting after PENDING_TIMEOUT_SEC and skip the node as a corrupted one
+	now = (u64_t)(u32_t)opt_time(NULL);
+	mark = queue->stall_mark;
+	if((mark>>32)!=key)
+	{
+		queue->stall_mark = ((u64_t)key<<32) | now;
+		return 1;
+	}
+	return (u32_t)(now-(u32_t)mark) < PENDING_TIMEOUT_SEC;
+}
+
+// Mark nodes from pos to end as consumed, they are reclaimed when free_pos reaches pos
+// Called by the reader which moved head_pos over these nodes
+static void skip_nodes(struct sq_head_t *queue, u64_t pos, u64_t end)
+{
+	u64_t i;
+
+	if(pos==end)
+		return;
+	// reset start_token so that these nodes will not be treated as a starting node of data
+	for(i=pos+1; i!=end && reset_interior(queue); i++)
+		SQ_GET(queue, SQ_IDX(queue, i))->start_token = 0;
+	write_pad(SQ_GET(queue, SQ_IDX(queue, pos)), (int)(end-pos), sq_token(queue, pos, PAD_TOKEN));
+}
+
+// Wake up the writers blocked in sq_put_wait() if no more nodes than the low watermark are used before pos,
+// from where the nodes are given back to the writers. Only the caller's view is checked, the writers check again
+static inline void wake_writers(struct sq_head_t *queue, u64_t pos)
+{
+	if(queue->space_waiters && (int)(queue->tail_pos-pos)<=queue->watermark_low)
+	{
+		__sync_fetch_and_add(&queue->space_futex, 1);
+		syscall(SYS_futex, &queue->space_futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+// Move free_pos forward over the nodes released by the readers, so that the writer can reuse them
+static void advance_free_pos(struct sq_head_t *queue)
+{
+	u64_t free_pos;
+	int nr_nodes;
+	u32_t token;
+	struct sq_node_head_t *node;
+
+	while((free_pos = queue->free_pos)!=queue->head_pos)
+	{
+		node = SQ_GET(queue, SQ_IDX(queue, free_pos));
+		token = node->start_token;
+		if(token==sq_token(queue, free_pos, FREE_TOKEN))
+			nr_nodes = SQ_NUM_NEEDED_NODES(queue, node->datalen);
+		else if(token==sq_token(queue, free_pos, PAD_TOKEN))
+			nr_nodes = node->datalen;
+		else // still being read, or not marked by its reader yet
+			break;
+
+		// whoever resets the token moves free_pos forward
+		if(!CAS32(&node->start_token, token, 0))
+			continue;
+		if(!CAS64(&queue->free_pos, free_pos, free_pos+nr_nodes))
+			node->start_token = token; // free_pos moved on and the node was reused, not ours
+	}
+	// the CAS on free_pos is a full barrier, space_waiters is read after it
+	wake_writers(queue, queue->free_pos);
+}
+
+// With SQ_FLAG_OVERWRITE, drop the oldest data until head_pos reaches pos, as if a reader claimed and released them
+// Data not committed yet stop it, and the nodes already claimed by the readers are freed only after they are read
+// Returns non-zero if head_pos was moved
+static int drop_oldest(struct sq_head_t *queue, u64_t pos)
+{
+	struct sq_node_head_t *node;
+	u64_t old_head, head, tail;
+	int nr_nodes, dropped;
+
+	// readers take cached_tail_pos as never behind head_pos, so bring it up to where head_pos may go first
+	tail = refresh_pos(&queue->cached_tail_pos, &queue->tail_pos);
+	do
+	{
+		head = old_head = queue->head_pos;
+		dropped = 0;
+		while(head<pos && head!=tail)
+		{
+			node = SQ_GET(queue, SQ_IDX(queue, head));
+			if(node->start_token==sq_token(queue, head, PAD_TOKEN) && node->datalen>0 && node->datalen<=tail-head)
+			{
+				head += node->datalen;
+				continue;
+			}
+			if(SQ_IS_MULTI_PRODUCER(queue) && node_pending(queue, head, node)) // still being written
+				break;
+			nr_nodes = SQ_NUM_NEEDED_NODES(queue, node->datalen);
+			if((node->start_token!=sq_token(queue, head, START_TOKEN) && node->start_token!=sq_token(queue, head, CHUNK_TOKEN)) || node->datalen==0 ||
+				node->datalen>MAX_SQ_DATA_LENGTH || (u64_t)nr_nodes>tail-head)
+			{
+				head ++; // corrupted, left for the readers to count
+				continue;
+			}
+			head += nr_nodes;
+			dropped ++;
+		}
+		if(head==old_head)
+			return 0;
+	} while(!CAS64(&queue->head_pos, old_head, head)); // raced with a reader or another writer
+
+	skip_nodes(queue, old_head, head);
+	advance_free_pos(queue);
+	refresh_pos(&queue->cached_free_pos, &queue->free_pos);
+	if(dropped)
+		SQ_STAT_ADD(queue, dropped, dropped);
+	return 1;
+}
+
+// With SQ_FLAG_OVERWRITE, make room for the nodes before pos, seeing free_pos and old_tail before
+// With several producers the data may have been dropped by another writer already, or be in the middle of it,
+// or the oldest data be still being put by another writer: the caller tries again after the positions move,
+// yielding up to SQ_DROP_WAITS times in all (waits) for what is in the middle
+// Returns non-zero if the caller should try to claim the nodes again, or 0 if the oldest data
+// can't be dropped: being read, or not committed for too long
+static int make_room(struct sq_head_t *queue, u64_t free_pos, u64_t old_tail, u64_t pos, int *waits)
+{
+	if(drop_oldest(queue, pos))
+		return 1;
+	if(!SQ_IS_MULTI_PRODUCER(queue))
+		return 0;
+	advance_free_pos(queue); // the nodes dropped by another writer may not be given back yet
+	if(refresh_pos(&queue->cached_free_pos, &queue->free_pos)!=free_pos || queue->tail_pos!=old_tail)
+		return 1;
+	// unless claimed by a reader, the node at free_pos is not committed yet, which its writer does soon,
+	// or head_pos was just moved over it and it's not marked yet
+	if((free_pos!=queue->head_pos && SQ_IS_READ_TOKEN(SQ_GET(queue, SQ_IDX(queue, free_pos))->start_token)) ||
+		++*waits>SQ_DROP_WAITS)
+		return 0;
+	sched_yield();
+	return 1;
+}
+
+// Mark a data node claimed by claim_data() as consumed, call advance_free_pos() afterwards
+static void free_node(struct sq_head_t *queue, struct sq_node_head_t *node)
+{
+	int idx = SQ_NODE_IDX(queue, node);
+	int end = idx+SQ_NUM_NEEDED_NODES(queue, node->datalen); // data never wraps around, but may run into the mirror
+	u32_t token = FREE_TOKEN;
+
+	if(SQ_IS_SEQUENCE(queue)) // not released yet, so free_pos can't be beyond it
+		token = sq_token(queue, idx_to_pos(queue, queue->free_pos, idx), FREE_TOKEN);
+	// reset start_token of the following nodes, so that they won't be treated as a starting node of data
+	for(idx++; idx<end && reset_interior(queue); idx++)
+		SQ_GET(queue, idx)->start_token = 0;
+	BARRIER(); // finish reading before the writer may reuse the node
+	node->start_token = token;
+}
+
+// Release the data node claimed by claim_data()
+static void release_node(struct sq_head_t *queue, struct sq_node_head_t *node)
+{
+	free_node(queue, node);
+	advance_free_pos(queue);
+}
+
+// Free the data node at free_pos if the reader process which claimed it exited without releasing it,
+// otherwise the writer could never reuse the queue again. Called by the writers when the queue looks full
+// Returns non-zero if the node was freed
+static int reclaim_node(struct sq_head_t *queue)
+{
+	struct sq_node_head_t *node;
+	u64_t free_pos = queue->free_pos;
+	u32_t token;
+
+	if(free_pos==queue->head_pos)
+		return 0;
+	node = SQ_GET(queue, SQ_IDX(queue, free_pos));
+	token = node->start_token;
+	if(!SQ_IS_READ_TOKEN(token) || kill((pid_t)(token>>3), 0)==0 || errno!=ESRCH)
+		return 0;
+	if(!CAS32(&node->start_token, token, 0)) // freed by someone else
+		return 0;
+	free_node(queue, node);
+	advance_free_pos(queue);
+	return 1;
+}
+
+// Record used as the high water mark if it's higher
+static inline void update_high_water(struct sq_head_t *queue, u64_t used)
+{
+	u64_t old;
+
+	while(used>(old = queue->high_water) && !CAS64(&queue->high_water, old, used));
+}
+
+// Decide what a reader does with the chunk node at head, stream is the tid of the reader of large data, or 0
+// The reader taking the first chunk becomes the stream_reader, and the others leave the following chunks to it
+// Returns 1 to take the chunk, 0 to leave it, or -1 to skip it as a chunk of data whose reader or writer is gone
+static int chunk_action(struct sq_head_t *queue, struct sq_node_head_t *node, pid_t stream, int *acquired)
+{
+	pid_t reader = queue->stream_reader;
+
+	if(SQ_CHUNK(queue, node)->offset==0) // starts new data, the data read before (if any) is broken
+	{
+		if(stream==0)
+			return 0;
+		if(reader==stream)
+			return 1;
+		if(reader && is_pid_valid(reader))
+			return 0; // still reading the chunks of the data before
+		return (*acquired = CAS32(&queue->stream_reader, reader, stream));
+	}
+	if(reader==0)
+		return -1;
+	if(reader==stream)
+		return 1;
+	if(is_pid_valid(reader))
+		return 0;
+	CAS32(&queue->stream_reader, reader, 0); // died in the middle
+	return -1;
+}
+
+// Find up to max_count data from head, no more than max_bytes in total (except the first one),
+// and move head_pos over all of them at once
+// Chunks of large data are only claimed by themselves, by the reader of large data whose tid is stream, see chunk_action()
+// With chunks_only, such a reader stops at any other data, as it's reading the chunks after the first
+// The data nodes are owned by the caller until release_node() is called
+// Returns the number of data with their node indexes in idx[], or 0 if no data in queue
+static int claim_data(struct sq_head_t *queue, int *idx, int max_count, int max_bytes, pid_t stream, int chunks_only)
+{
+	struct sq_node_head_t *node;
+
+	int nr_nodes, datalen;
+	u64_t old_head, head, tail, pos, now = 0;
+	int i, n, bytes, corrupted, expired;
+	int acquired = 0;
+
+	head = old_head = queue->head_pos;
+	tail = queue->cached_tail_pos; // read after head_pos, never behind it
+	n = bytes = corrupted = expired = 0;
+	do
+	{
+		node = SQ_GET(queue, SQ_IDX(queue, head));
+		if(n<max_count && head==tail) // looks empty, see if more data is committed
+		{
+			tail = refresh_pos(&queue->cached_tail_pos, &queue->tail_pos);
+			update_high_water(queue, tail-old_head);
+		}
+		if(n==max_count || head==tail || wait_for_commit(queue, head, node)) // end of queue or data not committed yet
+		{
+stop_here:
+			if(head==old_head) // head_pos not advanced
+				return 0;
+			if(CAS64(&queue->head_pos, old_head, head))
+				break;
+			// head_pos changed by someone else, start over
+			SQ_STAT_ADD(queue, cas_retries, 1);
+			if(acquired) // the first chunk may be gone
+				acquired = !CAS32(&queue->stream_reader, stream, 0);
+			head = old_head = queue->head_pos;
+			tail = queue->cached_tail_pos;
+			n = bytes = corrupted = expired = 0;
+			continue;
+		}
+
+		if(node->start_token==sq_token(queue, head, PAD_TOKEN) && node->datalen>0 && node->datalen<=(u32_t)SQ_USED_NODES3(queue, head, tail))
+		{
+			// nodes skipped by the writer on wrap around, or reserved but not used
+			head += node->datalen;
+			continue;
+		}
+		if(node->start_token!=sq_token(queue, head, START_TOKEN) && node->start_token!=sq_token(queue, head, PENDING_TOKEN) &&
+			node->start_token!=sq_token(queue, head, CHUNK_TOKEN))
+		{
+			head ++;
+			corrupted ++;
+			continue;
+		}
+		datalen = node->datalen;
+		nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
+		if(SQ_USED_NODES3(queue, head, tail) < nr_nodes)
+		{
+			head ++;
+			corrupted ++;
+			continue;
+		}
+		if(node->start_token==sq_token(queue, head, PENDING_TOKEN)) // given up by wait_for_commit(), skip the whole data
+		{
+			head += nr_nodes;
+			corrupted += nr_nodes;
+			continue;
+		}
+		if(node->start_token==sq_token(queue, head, CHUNK_TOKEN)) // the TTL doesn't apply to large data
+		{
+			if(n>0)
+				goto stop_here;
+			switch(chunk_action(queue, node, stream, &acquired))
+			{
+			case 1:
+				idx[n++] = SQ_IDX(queue, head);
+				head += nr_nodes;
+				goto stop_here;
+			case 0:
+				goto stop_here;
+			default:
+				head += nr_nodes;
+				corrupted ++;
+				continue;
+			}
+		}
+		if(chunks_only)
+			goto stop_here;
+		if(queue->ttl_ns && data_expired(queue, node, &now)) // skipped without reading the data
+		{
+			head += nr_nodes;
+			expired ++;
+			continue;
+		}
+		if(n>0 && bytes+datalen>max_bytes)
+			goto stop_here;
+		idx[n++] = SQ_IDX(queue, head);
+		bytes += datalen;
+		head += nr_nodes;
+	} while(1);
+
+	if(n>0 && queue->stall_mark) // the node waited for is committed
+		queue->stall_mark = 0;
+	if(corrupted)
+		SQ_STAT_ADD(queue, corrupted, corrupted);
+	if(expired)
+		SQ_STAT_ADD(queue, expired, expired);
+
+	// the nodes skipped between the data are reclaimed at once,
+	// and the data nodes are marked with our pid, see reclaim_node()
+	for(i=0; i<n; i++)
+	{
+		node = SQ_GET(queue, idx[i]);
+		node->start_token = SQ_READ_TOKEN(my_pid, node->start_token);
+		pos = idx_to_pos(queue, old_head, idx[i]);
+		skip_nodes(queue, old_head, pos);
+		old_head = pos+SQ_NUM_NEEDED_NODES(queue, SQ_GET(queue, idx[i])->datalen);
+	}
+	skip_nodes(queue, old_head, head);
+	if(n==0)
+		advance_free_pos(queue);
+	return n;
+}
+
+int sq_latency_bucket(u64_t ns)
+{
+	int msb, idx;
+
+	if(ns < (1<<SQ_LATENCY_SUB_BITS))
+		return (int)ns;
+	msb = 63 - __builtin_clzll(ns);
+	idx = ((msb-SQ_LATENCY_SUB_BITS+1)<<SQ_LATENCY_SUB_BITS) + (int)((ns>>(msb-SQ_LATENCY_SUB_BITS)) & ((1<<SQ_LATENCY_SUB_BITS)-1));
+	return idx<SQ_LATENCY_BUCKETS? idx : SQ_LATENCY_BUCKETS-1;
+}
+
+u64_t sq_latency_value(int idx)
+{
+	int shift = (idx>>SQ_LATENCY_SUB_BITS) - 1;
+
+	if(shift<0)
+		return idx;
+	return ((((u64_t)1<<SQ_LATENCY_SUB_BITS) + (idx & ((1<<SQ_LATENCY_SUB_BITS)-1)) + 1)<<shift) - 1;
+}
+
+// Count ns, the time a data has been in queue, in the latency histogram
+static void record_latency(struct sq_head_t *queue, long long ns)
+{
+	struct sq_latency_hist_t *hist = queue->latency+my_shard()%SQ_LATENCY_SHARDS;
+	u64_t max;
+	__sync_fetch_and_add(&hist->buckets[sq_latency_bucket(ns)], 1);
+	__sync_fetch_and_add(&hist->count, 1);
+	__sync_fetch_and_add(&hist->total_ns, ns);
+	while((u64_t)ns>(max = hist->max_ns) && !CAS64(&hist->max_ns, max, (u64_t)ns));
+}
+
+// Retrieve data
+// On success, buf is filled with the first queue data
+// Returns the data length or
+//     0  - no data in queue
+//     -1 - invalid parameter
+//     -2 - buf_sz is too small, the data is dropped
+int sq_get(struct sq_head_t *queue, void *buf, int buf_sz, struct timeval *enqueue_time)
+{
+	struct sq_node_head_t *node;
+	int datalen, idx;
+
+	if(queue==NULL || buf==NULL || buf_sz<1)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Broadcast queue can only be read by subscribers");
 		return -1;
 	}
 
-	// calculate the number of nodes needed   计算数据需要多少块
-	nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
+	if(claim_data(queue, &idx, 1, buf_sz, 0, 0)==0)
+		return 0;
 
-	if(SQ_EMPTY_NODES(queue)<nr_nodes)
+	node = SQ_GET(queue, idx);
+	datalen = node->datalen;
+	if(enqueue_time)
+		get_enqueue_time(queue, node, enqueue_time);
+	if(datalen > buf_sz)
 	{
-		snprintf(errmsg, sizeof(errmsg), "Not enough for new data");
-		return -2;
+		snprintf(errmsg, sizeof(errmsg), "Data length(%u) exceeds supplied buffer size of %u", datalen, buf_sz);
+		datalen = -2;
+	}
+	else
+	{
+		memcpy(buf, SQ_NODE_DATA(queue, node), datalen);
+		SQ_STAT_ADD(queue, get_bytes, datalen);
 	}
+	SQ_STAT_ADD(queue, gets, 1);
+	if(SQ_HAS_LATENCY(queue))
+		record_latency(queue, node_age_ns(queue, node));
+	release_node(queue, node);
+	return datalen;
+}
 
-	idx = queue->tail_pos;
-	node = SQ_GET(queue, idx);
-	new_tail = SQ_ADD_TAIL(queue, nr_nodes);
+// Retrieve up to max_count data at once, moving head_pos only once
+// The data are copied to buf one after another, no more than buf_sz bytes in total,
+// with the length of each data returned in lens[] and enqueue time in enqueue_times[] (optional)
+// Returns the number of data retrieved or
+//     0  - no data in queue
+//     -1 - invalid parameter
+//     -2 - the first data exceeds buf_sz, it is dropped
+int sq_get_batch(struct sq_head_t *queue, void *buf, int buf_sz, int *lens, struct timeval *enqueue_times, int max_count)
+{
+	struct sq_node_head_t *node;
+	int i, n, datalen;
+	char *p = (char*)buf;
+	long bytes = 0;
 
-	if(new_tail < queue->tail_pos) // wrapped back  //如果出现反包
+	if(queue==NULL || buf==NULL || buf_sz<1 || lens==NULL || max_count<1)
 	{
-		// We need a set of continuous nodes
-		// So skip the empty nodes at the end, and begin allocation at index 0
-		idx = 0;
-		new_tail = nr_nodes;
-		node = SQ_GET(queue, 0);
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Broadcast queue can only be read by subscribers");
+		return -1;
+	}
 
-		if(queue->head_pos-1 < nr_nodes) //head_pos标识的是空闲的包个数 tail_pos 标识的是使用的包个数
+	// lens[] holds the node indexes until the data are copied out
+	n = claim_data(queue, lens, max_count, buf_sz, 0, 0);
+	for(i=0; i<n; i++)
+	{
+		node = SQ_GET(queue, lens[i]);
+		if(SQ_HAS_LATENCY(queue))
+			record_latency(queue, node_age_ns(queue, node));
+		datalen = node->datalen;
+		if(enqueue_times)
+			get_enqueue_time(queue, node, enqueue_times+i);
+		if(datalen > buf_sz) // only possible for the first one
 		{
-			snprintf(errmsg, sizeof(errmsg), "Not enough for new data");
-			return -2; // not enough empty nodes
+			snprintf(errmsg, sizeof(errmsg), "Data length(%u) exceeds supplied buffer size of %u", datalen, buf_sz);
+			n = -2;
+		}
+		else
+		{
+			memcpy(p, SQ_NODE_DATA(queue, node), datalen);
+			p += datalen;
+			bytes += datalen;
 		}
+		lens[i] = datalen;
+		free_node(queue, node);
+	}
+	if(n)
+	{
+		advance_free_pos(queue);
+		SQ_STAT_ADD(queue, gets, n>0? n : 1);
+		SQ_STAT_ADD(queue, get_bytes, bytes);
 	}
+	return n;
+}
 
-	// initialize the new node
-	node->start_token = START_TOKEN;
-	node->datalen = datalen;
-	opt_gettimeofday(&node->enqueue_time, NULL);  //插入节点时候的时间
-	memcpy(node->data, data, datalen);
-	queue->tail_pos = new_tail;
+// Retrieve data without copying
+// On success, *data points to the first queue data in shm, which stays valid until sq_release()
+// Returns the data length or
+//     0  - no data in queue
+//     -1 - invalid parameter
+int sq_peek(struct sq_head_t *queue, void **data, struct timeval *enqueue_time)
+{
+	struct sq_node_head_t *node;
+	int datalen, idx;
 
-	// now signal the reader wait on queue
-	if(queue->data_signum && // needs signaling    信号触发被设置而且 当已经使用的节点数超高了信号要求的节点数
-		SQ_USED_NODES(queue)>=queue->sig_node_num) // element num reached
+	if(queue==NULL || data==NULL)
 	{
-		int i, nr;
-		// signal at most queue->sig_process_num processes
-		for(i=0,nr=0; i<(int)queue->pidnum && nr<queue->sig_process_num; i++) //分别给不同的进程发信号
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Broadcast queue can only be read by subscribers");
+		return -1;
+	}
+
+	if(claim_data(queue, &idx, 1, 0, 0, 0)==0)
+		return 0;
+
+	node = SQ_GET(queue, idx);
+	datalen = node->datalen;
+	if(enqueue_time)
+		get_enqueue_time(queue, node, enqueue_time);
+	*data = SQ_NODE_DATA(queue, node);
+	SQ_STAT_ADD(queue, gets, 1);
+	SQ_STAT_ADD(queue, get_bytes, datalen);
+	if(SQ_HAS_LATENCY(queue))
+		record_latency(queue, node_age_ns(queue, node));
+	return datalen;
+}
+
+// Give the data returned by sq_peek() back to the writer
+// Returns 0 on success, -1 if parameter is bad
+int sq_release(struct sq_head_t *queue, void *data)
+{
+	struct sq_node_head_t *node;
+
+	if(queue==NULL || (node = data_to_node(queue, data))==NULL || SQ_TOKEN_KIND(node->start_token)!=READ_TOKEN)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	release_node(queue, node);
+	return 0;
+}
+
+// Wait for the next chunk of the large data put by writer, until deadline (forever if NULL)
+// Returns 1 with the node index in *idx, or 0 if the writer is gone without putting it, or on timeout
+static int next_chunk(struct sq_head_t *queue, pid_t stream, pid_t writer, int *idx, const struct timespec *deadline)
+{
+	struct timespec ts;
+	int gone = 0, wait_ms;
+
+	while(claim_data(queue, idx, 1, 0, stream, 1)==0)
+	{
+		if(queue->stream_writer!=writer) // done or given up, all its chunks are in queue, have a last look
 		{
-			if(queue->pidset[i] && queue->sigmask[i/8] & 1<<(i%8))
-			{
-				kill((pid_t)queue->pidset[i], SIGUSR1);
-				nr ++;
-				sq_sigoff(queue, i); // avoids being signaled again
-			}
+			if(gone++)
+				return 0;
+			continue;
+		}
+		wait_ms = SQ_CHUNK_WAIT_MS;
+		if(deadline)
+		{
+			if(time_left(deadline, &ts)<0)
+				return 0;
+			if(ts.tv_sec==0 && ts.tv_nsec/1000000<wait_ms)
+				wait_ms = ts.tv_nsec/1000000;
 		}
+		if(sq_timedwait(queue, wait_ms)==0 && !is_pid_valid(writer))
+			return 0;
 	}
-	return 0;
+	return 1;
 }
 
-int sq_get_usage(struct sq_head_t *queue)
+// Give the nodes of the data in iov[] back to the writer, the data of chunks follow their chunk heads
+static void release_iov(struct sq_head_t *queue, const struct iovec *iov, int count)
 {
-	return queue->ele_count? ((SQ_USED_NODES(queue))*100)/queue->ele_count : 0;
+	struct sq_node_head_t *node;
+	int i;
+
+	for(i=0; i<count; i++)
+	{
+		node = data_to_node(queue, iov[i].iov_base);
+		free_node(queue, node? node : data_to_node(queue, (char*)iov[i].iov_base-sizeof(struct sq_chunk_head_t)));
+	}
+	advance_free_pos(queue);
 }
 
-int sq_get_used_blocks(struct sq_head_t *queue)
+// Read the next data for sq_get_large()/sq_peek_large(), joining the chunks of large data
+// With buf, the data is copied to buf and its nodes released, otherwise iov[] point to its parts in shm
+// Returns as sq_get_large()
+static int get_large(struct sq_head_t *queue, char *buf, int buf_sz, struct iovec *iov, int *iov_count, struct timeval *enqueue_time, int timeout_ms)
 {
-	return SQ_USED_NODES(queue);
+	struct sq_node_head_t *node;
+	struct sq_chunk_head_t *chunk;
+	struct timespec deadline;
+	pid_t stream = syscall(SYS_gettid), writer = 0;
+	int idx, len, nr_chunks;
+	int total = 0, offset = 0, n = 0, drop = 0;
+	char *data;
+
+	if(claim_data(queue, &idx, 1, 0, stream, 0)==0)
+		return 0;
+	if(timeout_ms>=0)
+		get_deadline(timeout_ms, &deadline);
+	node = SQ_GET(queue, idx);
+	while(1)
+	{
+		SQ_STAT_ADD(queue, gets, 1);
+		if(!SQ_IS_CHUNK(node)) // usual data, all in this node
+		{
+			chunk = NULL;
+			data = (char*)SQ_NODE_DATA(queue, node);
+			len = node->datalen;
+		}
+		else
+		{
+			chunk = SQ_CHUNK(queue, node);
+			data = (char*)(chunk+1);
+			len = node->datalen-sizeof(*chunk);
+			if(chunk->offset==0 && offset>0) // the data before is broken, start over with this one
+			{
+				if(n)
+					release_iov(queue, iov, n);
+				n = offset = drop = 0;
+				SQ_STAT_ADD(queue, corrupted, 1);
+			}
+			if(chunk->offset!=(u32_t)offset || (offset>0 && (chunk->total!=(u32_t)total || chunk->writer!=writer)) ||
+				len<=0 || chunk->total-offset<(u32_t)len)
+			{
+				release_node(queue, node);
+				goto broken;
+			}
+		}
+		if(offset==0)
+		{
+			total = chunk? (int)chunk->total : len;
+			writer = chunk? chunk->writer : 0;
+			nr_chunks = (total+len-1)/len;
+			if(buf? total>buf_sz : nr_chunks>*iov_count || nr_chunks*SQ_NUM_NEEDED_NODES(queue, node->datalen)>queue->ele_count)
+			{
+				snprintf(errmsg, sizeof(errmsg), "Data length(%d) exceeds supplied buffer size", total);
+				drop = 1;
+			}
+			if(enqueue_time)
+				get_enqueue_time(queue, node, enqueue_time);
+			if(SQ_HAS_LATENCY(queue))
+				record_latency(queue, node_age_ns(queue, node));
+		}
+
+		if(buf || drop)
+		{
+			if(!drop)
+				memcpy(buf+offset, data, len);
+			release_node(queue, node);
+		}
+		else
+		{
+			iov[n].iov_base = data;
+			iov[n++].iov_len = len;
+		}
+		offset += len;
+		if(offset==total)
+			break;
+		if(!next_chunk(queue, stream, writer, &idx, timeout_ms>=0? &deadline : NULL))
+			goto broken;
+		node = SQ_GET(queue, idx);
+	}
+
+	if(queue->stream_reader==stream)
+		CAS32(&queue->stream_reader, stream, 0);
+	if(drop)
+		return -2;
+	SQ_STAT_ADD(queue, get_bytes, total);
+	if(iov_count)
+		*iov_count = n;
+	return total;
+
+broken:
+	if(n)
+		release_iov(queue, iov, n);
+	if(queue->stream_reader==stream)
+		CAS32(&queue->stream_reader, stream, 0);
+	SQ_STAT_ADD(queue, corrupted, 1);
+	snprintf(errmsg, sizeof(errmsg), "Large data broken, its writer is gone or too slow");
+	return -3;
 }
 
-// Retrieve data
-// On success, buf is filled with the first queue data
+// Retrieve the next data, joining the chunks of large data put by sq_put_large() into buf
 // Returns the data length or
 //     0  - no data in queue
 //     -1 - invalid parameter
-int sq_get(struct sq_head_t *queue, void *buf, int buf_sz, struct timeval *enqueue_time)
+//     -2 - buf_sz is too small, the data is dropped
+//     -3 - the rest of large data didn't come in timeout_ms, or its writer is gone, the data is dropped
+int sq_get_large(struct sq_head_t *queue, void *buf, int buf_sz, struct timeval *enqueue_time, int timeout_ms)
 {
-	struct sq_node_head_t *node;
+	if(queue==NULL || buf==NULL || buf_sz<1 || SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	return get_large(queue, (char*)buf, buf_sz, NULL, NULL, enqueue_time, timeout_ms);
+}
 
-	int nr_nodes, datalen;
-	int old_head, new_head, head;
+// Zero-copy version of sq_get_large(), iov[] point to the parts of the data in shm, one for each chunk
+// *iov_count is the size of iov[] on input, and the number of parts on output
+// Returns as sq_get_large(), -2 if the parts don't fit in iov[] or the whole data doesn't fit in queue
+int sq_peek_large(struct sq_head_t *queue, struct iovec *iov, int *iov_count, struct timeval *enqueue_time, int timeout_ms)
+{
+	if(queue==NULL || iov==NULL || iov_count==NULL || *iov_count<1 || SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	return get_large(queue, NULL, 0, iov, iov_count, enqueue_time, timeout_ms);
+}
 
-	if(queue==NULL || buf==NULL || buf_sz<1)
+// Give the data returned by sq_peek_large() back to the writer
+// Returns 0 on success, -1 if parameter is bad
+int sq_release_large(struct sq_head_t *queue, const struct iovec *iov, int iov_count)
+{
+	if(queue==NULL || iov==NULL || iov_count<1)
 	{
 		snprintf(errmsg, sizeof(errmsg), "Bad argument");
 		return -1;
 	}
+	release_iov(queue, iov, iov_count);
+	return 0;
+}
 
-	head = old_head = queue->head_pos;
-	do
+// Returns the cursor of subscriber sub, or NULL if it's not valid
+static struct sq_cursor_t *get_cursor(struct sq_head_t *queue, int sub)
+{
+	if(!SQ_IS_BROADCAST(queue) || (u32_t)sub>=MAX_SUBSCRIBER_NUM || queue->cursors[sub].pid==0)
+		return NULL;
+	return queue->cursors+sub;
+}
+
+// Start reading from the current tail, the data before it are not for this subscriber
+static void join_at_tail(struct sq_head_t *queue, struct sq_cursor_t *cursor)
+{
+	cursor->pos = queue->tail_pos;
+	cursor->evicted = 0;
+	// a full barrier, the writer either sees us back, or we see the tail it may go beyond
+	__sync_synchronize();
+	cursor->pos = cursor->cached_tail_pos = queue->tail_pos;
+}
+
+// Find the next data from the cursor of a subscriber, skipping the expired ones if ttl is set
+// Returns the node with *pos set to its position and *datalen to its length, or NULL if no data
+static struct sq_node_head_t *next_data(struct sq_head_t *queue, struct sq_cursor_t *cursor, u64_t *pos, int *datalen, int ttl)
+{
+	struct sq_node_head_t *node;
+	u64_t tail = cursor->cached_tail_pos, now = 0;
+	int nr_nodes;
+
+	*pos = cursor->pos;
+	while(1)
 	{
-		if(queue->tail_pos==head) // end of queue
+		if(*pos==tail)
 		{
-			if(head!=old_head && CAS32(&queue->head_pos, old_head, head))
-			{
-				new_head = head;
-				datalen = 0;
+			if(*pos==(tail = cursor->cached_tail_pos = queue->tail_pos))
 				break;
-			}
-			// head_pos not advanced or changed by someone else, simply returns
-			return 0;
-		}
-
-		node = SQ_GET(queue, head);
-		if(node->start_token!=START_TOKEN)
-		{
-			head = SQ_ADD_POS(queue, head, 1);
-			continue;
+			update_high_water(queue, tail-*pos);
 		}
-		datalen = node->datalen;
-		nr_nodes = SQ_NUM_NEEDED_NODES(queue, datalen);
-		if(SQ_USED_NODES2(queue, head) < nr_nodes)
+		node = SQ_GET(queue, SQ_IDX(queue, *pos));
+		*datalen = node->datalen;
+		if(node->start_token==sq_token(queue, *pos, PAD_TOKEN) && *datalen>0 && (u32_t)*datalen<=tail-*pos)
 		{
-			head = SQ_ADD_POS(queue, head, 1);
+			*pos += *datalen;
 			continue;
 		}
-		new_head = SQ_ADD_POS(queue, head, nr_nodes);
-		if(CAS32(&queue->head_pos, old_head, new_head))
+		nr_nodes = SQ_NUM_NEEDED_NODES(queue, *datalen);
+		if(node->start_token==sq_token(queue, *pos, START_TOKEN) && *datalen>0 && *datalen<=MAX_SQ_DATA_LENGTH &&
+			(u32_t)nr_nodes<=tail-*pos && (SQ_IDX(queue, *pos)+nr_nodes<=queue->ele_count || SQ_IS_MIRROR(queue)))
 		{
-			if(enqueue_time)
-				*enqueue_time = node->enqueue_time;
-			if(datalen > buf_sz)
+			if(ttl && queue->ttl_ns && data_expired(queue, node, &now)) // skipped without reading the data
 			{
-				snprintf(errmsg, sizeof(errmsg), "Data length(%u) exceeds supplied buffer size of %u", datalen, buf_sz);
-				return -2;
+				*pos += nr_nodes;
+				SQ_STAT_ADD(queue, expired, 1);
+				continue;
 			}
-			memcpy(buf, node->data, datalen);
-			break;
+			cursor->pos = *pos; // the pads are skipped
+			return node;
 		}
-		else // head_pos changed by someone else, start over
+		(*pos) ++; // corrupted, look for the next start token
+		SQ_STAT_ADD(queue, corrupted, 1);
+	}
+	cursor->pos = *pos;
+	return NULL;
+}
+
+// Subscribe to a broadcast queue, data put from now on will all be seen by this subscriber
+// Returns a subscriber index for sq_sub_xxx(), or < 0 on failure
+int sq_subscribe(struct sq_head_t *queue)
+{
+	pid_t pid, mypid = getpid();
+	int i;
+
+	if(queue==NULL || !SQ_IS_BROADCAST(queue))
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	for(i=0; i<MAX_SUBSCRIBER_NUM; i++)
+	{
+		// reuse the cursor of a subscriber that exited without sq_unsubscribe()
+		pid = queue->cursors[i].pid;
+		if((pid==0 || !is_pid_valid(pid)) && CAS32(&queue->cursors[i].pid, pid, mypid))
 		{
-			old_head = queue->head_pos;
-			head = old_head;
+			join_at_tail(queue, queue->cursors+i);
+			return i;
 		}
-	} while(1);
+	}
+	snprintf(errmsg, sizeof(errmsg), "subscriber num exceeds maximum of %u", MAX_SUBSCRIBER_NUM);
+	return -1;
+}
+
+// Stop the writer from waiting for subscriber sub
+// Returns 0 on success, -1 if parameter is bad
+int sq_unsubscribe(struct sq_head_t *queue, int sub)
+{
+	struct sq_cursor_t *cursor;
+
+	if(queue==NULL || (cursor = get_cursor(queue, sub))==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	cursor->pid = 0;
+	return 0;
+}
+
+// Retrieve the next data of subscriber sub
+// Returns the data length or
+//     0  - no data in queue
+//     -1 - invalid parameter
+//     -2 - buf_sz is too small, the data is skipped
+//     -3 - evicted by the writer, the data not read yet are lost and reading goes on from the tail
+int sq_sub_get(struct sq_head_t *queue, int sub, void *buf, int buf_sz, struct timeval *enqueue_time)
+{
+	struct sq_cursor_t *cursor;
+	struct sq_node_head_t *node;
+	long long age = 0;
+	u64_t pos;
+	int datalen, ret;
+
+	if(queue==NULL || buf==NULL || buf_sz<1 || (cursor = get_cursor(queue, sub))==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(cursor->evicted)
+		goto evicted;
+
+	node = next_data(queue, cursor, &pos, &datalen, 1);
+	if(node==NULL)
+		return 0;
+	// the node may be overwritten once read, if this subscriber is evicted
+	if(SQ_HAS_LATENCY(queue))
+		age = node_age_ns(queue, node);
+	if(enqueue_time)
+		get_enqueue_time(queue, node, enqueue_time);
+	if(datalen > buf_sz)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Data length(%u) exceeds supplied buffer size of %u", datalen, buf_sz);
+		ret = -2;
+	}
+	else
+	{
+		memcpy(buf, SQ_NODE_DATA(queue, node), datalen);
+		ret = datalen;
+	}
+	BARRIER(); // x86 doesn't reorder loads, evicted is read after the data
+	if(cursor->evicted) // overwritten while being read
+		goto evicted;
+	cursor->pos = pos+SQ_NUM_NEEDED_NODES(queue, datalen);
+	// the writer keeps free_pos by itself, but may be waiting for this subscriber
+	// no barrier here, a wakeup missed is made up by the writer checking again after SQ_BROADCAST_WAIT_MS
+	wake_writers(queue, cursor->pos);
+	SQ_STAT_ADD(queue, gets, 1);
+	if(ret>0)
+		SQ_STAT_ADD(queue, get_bytes, ret);
+	if(SQ_HAS_LATENCY(queue))
+		record_latency(queue, age);
+	return ret;
+
+evicted:
+	join_at_tail(queue, cursor);
+	snprintf(errmsg, sizeof(errmsg), "Evicted by the writer, data lost");
+	return -3;
+}
+
+// Zero-copy version of sq_sub_get(), the data stays in shm for the other subscribers
+// *data points to the next data of subscriber sub, and it's the next one again until sq_sub_release()
+// Returns the data length or
+//     0  - no data in queue
+//     -1 - invalid parameter
+//     -3 - evicted by the writer, the data not read yet are lost and reading goes on from the tail
+int sq_sub_peek(struct sq_head_t *queue, int sub, void **data, struct timeval *enqueue_time)
+{
+	struct sq_cursor_t *cursor;
+	struct sq_node_head_t *node;
+	u64_t pos;
+	int datalen;
 
-	while(old_head!=new_head)
+	if(queue==NULL || data==NULL || (cursor = get_cursor(queue, sub))==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(cursor->evicted)
 	{
-		node = SQ_GET(queue, old_head);
-		// reset start_token so that this node will not be treated as a starting node of data
-		node->start_token = 0;
-		old_head = SQ_ADD_POS(queue, old_head, 1);
+		join_at_tail(queue, cursor);
+		snprintf(errmsg, sizeof(errmsg), "Evicted by the writer, data lost");
+		return -3;
 	}
 
+	node = next_data(queue, cursor, &pos, &datalen, 1);
+	if(node==NULL)
+		return 0;
+	if(enqueue_time)
+		get_enqueue_time(queue, node, enqueue_time);
+	*data = SQ_NODE_DATA(queue, node);
 	return datalen;
 }
 
+// Move subscriber sub over the data returned by sq_sub_peek()
+// Returns 0 on success, -1 if parameter is bad, or
+//     -3 - evicted by the writer, the data returned by sq_sub_peek() may have been overwritten
+int sq_sub_release(struct sq_head_t *queue, int sub)
+{
+	struct sq_cursor_t *cursor;
+	struct sq_node_head_t *node;
+	long long age = 0;
+	u64_t pos;
+	int datalen;
+
+	if(queue==NULL || (cursor = get_cursor(queue, sub))==NULL || (node = next_data(queue, cursor, &pos, &datalen, 0))==NULL) // the one peeked, even if expired since
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(SQ_HAS_LATENCY(queue))
+		age = node_age_ns(queue, node);
+	BARRIER();
+	if(cursor->evicted)
+	{
+		join_at_tail(queue, cursor);
+		snprintf(errmsg, sizeof(errmsg), "Evicted by the writer, data lost");
+		return -3;
+	}
+	cursor->pos = pos+SQ_NUM_NEEDED_NODES(queue, datalen);
+	wake_writers(queue, cursor->pos); // see sq_sub_get()
+	SQ_STAT_ADD(queue, gets, 1);
+	SQ_STAT_ADD(queue, get_bytes, datalen);
+	if(SQ_HAS_LATENCY(queue))
+		record_latency(queue, age);
+	return 0;
+}
+
+// Wait until there is data in queue, or timeout_ms milliseconds passed (wait forever if timeout_ms<0)
+// Returns 1 if there is data in queue, 0 on timeout or interrupted by a signal, -1 if parameter is bad
+int sq_timedwait(struct sq_head_t *queue, int timeout_ms)
+{
+	struct timespec deadline, ts;
+	u32_t seq;
+	u64_t head;
+	int ret = 0;
+
+	if(queue==NULL)
+	{
+		snprintf(errmsg, sizeof(errmsg), "Bad argument");
+		return -1;
+	}
+	if(timeout_ms>=0)
+		get_deadline(timeout_ms, &deadline);
+
+	// a locked add is a full barrier, the writer either sees us waiting or we see its data
+	__sync_fetch_and_add(&queue->data_waiters, 1);
+	while(1)
+	{
+		seq = queue->data_futex;
+		head = queue->head_pos;
+		// in multi-producer mode, data claimed but not committed yet doesn't count
+		if(head!=queue->tail_pos && !(SQ_IS_MULTI_PRODUCER(queue) && node_pending(queue, head, SQ_GET(queue, SQ_IDX(queue, head)))))
+		{
+			ret = 1;
+			break;
+		}
+		if(timeout_ms>=0 && time_left(&deadline, &ts)<0)
+			break;
+		// no syscall on the writer side unless someone is sleeping here
+		if(syscall(SYS_futex, &queue->data_futex, FUTEX_WAIT, seq, timeout_ms>=0? &ts : NULL, NULL, 0)<0 && errno==EINTR)
+			break;
+	}
+	__sync_fetch_and_sub(&queue->data_waiters, 1);
+	return ret;
+}
+
+// Wait until there is data in queue
+int sq_wait(struct sq_head_t *queue)
+{
+	return sq_timedwait(queue, -1);
+}
+
 #if SQ_FOR_TEST
 
 //
@@ -651,8 +3367,9 @@ badarg:
 		printf("  quit\n");
 		printf("cmd>"); 
 		fflush(stdout);
-		if(gets(cmd)==NULL)
+		if(fgets(cmd, sizeof(cmd), stdin)==NULL)
 			return 0;
+		cmd[strcspn(cmd, "\n")] = 0;
 		if(strncmp(cmd, "put ", 4)==0)
 		{
 			char *pstr = cmd + 4;
@@ -15,6 +15,9 @@
 #ifndef __SHM_QUEUE_HEADER__
 #define __SHM_QUEUE_HEADER__
 
+#include <sys/time.h>
+#include <sys/uio.h>
+
 #ifndef BOOL
 #define BOOL int
 #endif
@@ -28,6 +31,10 @@
 #define SQ_FOR_TEST	0
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef unsigned short u16_t;
 typedef unsigned int u32_t;
 typedef unsigned long long u64_t;
@@ -35,6 +42,74 @@ typedef unsigned long long u64_t;
 // Maximum bytes allowed for a queue data 队列数据所允许的最大字节数
 #define MAX_SQ_DATA_LENGTH	65536   //2^16
 
+// Flags for sq_create_ex(), fixed for the lifetime of a queue  创建队列时指定的模式
+#define SQ_FLAG_MULTI_PRODUCER	0x0001 // allow sq_put() from several processes/threads without an external lock 多写者
+#define SQ_FLAG_POW2		0x0002 // round ele_count and node size up to powers of 2, so that no division is needed
+#define SQ_FLAG_BROADCAST	0x0004 // every subscriber gets every data, see sq_subscribe(), single writer only 广播
+#define SQ_FLAG_EVICT_LAGGARDS	0x0008 // with SQ_FLAG_BROADCAST, evict slow subscribers instead of failing sq_put() when full
+#define SQ_FLAG_LATENCY		0x0010 // readers record the time each data spent in queue, see sq_get_latency() 延迟统计
+#define SQ_FLAG_CLOCK_NS	0x0020 // timestamp the data with the calibrated TSC clock opt_clock_ns() in opt_time.h, at ns precision
+// Compact node headers for small data, 24 bytes by default  紧凑的节点头部
+#define SQ_FLAG_HEADER_NS	0x0040 // 16 bytes, timestamp by opt_clock_ns() as with SQ_FLAG_CLOCK_NS
+#define SQ_FLAG_HEADER_NONE	0x0080 // 8 bytes, no timestamp, enqueue_time is returned as 0 and SQ_FLAG_LATENCY is not allowed
+// Map the data area twice back to back, so that data is never split or skipped at the end of the ring  双重映射
+// Only for sq_create_posix()/sq_create_file()/sq_create_memfd(), ele_count is rounded up so that the data area is whole pages
+#define SQ_FLAG_MIRROR		0x01000000
+// Stamp the node tokens with their positions, like the per-slot sequence numbers of a Vyukov ring  带序号的节点
+// Tokens left by earlier rounds don't match, so with a single producer readers don't reset the tokens of the nodes they consume
+#define SQ_FLAG_SEQUENCE	0x02000000
+// When full, the writer drops the oldest data to make room instead of failing, e.g. for metrics and traces  覆盖最旧数据
+// Data being read at the moment are never dropped, see sq_put()
+#define SQ_FLAG_OVERWRITE	0x04000000
+
+// Flags for how the shm is mapped by this process, not stored in the queue  映射共享内存的方式
+#define SQ_FLAG_HUGETLB		0x0100 // create the shm with 2MB huge pages, normal pages are used if not available 大页
+#define SQ_FLAG_HUGETLB_1GB	0x0200 // create the shm with 1GB huge pages, 2MB/normal pages are used if not available
+#define SQ_FLAG_PREFAULT	0x0400 // map all the pages on attach, so that no page fault happens on data access 预先映射所有页
+#define SQ_FLAG_MLOCK		0x0800 // lock the shm in memory, sq_create_ex()/sq_open_ex() fail if not permitted 锁定内存
+#define SQ_FLAG_READONLY	0x8000 // sq_open_xxx() only, map the queue read-only for monitoring, e.g. sq_get_stat() 只读
+
+// NUMA placement of a new queue, at most one of them  NUMA内存分配策略
+#define SQ_FLAG_NUMA_INTERLEAVE	0x1000 // interleave the pages over all the NUMA nodes
+#define SQ_FLAG_NUMA_FIRST_TOUCH	0x2000 // leave the pages for the first process touching them, e.g. a reader opening with SQ_FLAG_PREFAULT
+#define SQ_FLAG_NUMA_BIND(node)	(0x4000 | ((node)&0xff)<<16) // put the pages on NUMA node (0-255)
+#define SQ_FLAG_NUMA_NODE(flags)	(((flags)>>16)&0xff)
+#define SQ_FLAGS_NUMA		(SQ_FLAG_NUMA_INTERLEAVE|SQ_FLAG_NUMA_FIRST_TOUCH|SQ_FLAG_NUMA_BIND(0xff))
+
+#define SQ_FLAGS_ATTACH		(SQ_FLAG_HUGETLB|SQ_FLAG_HUGETLB_1GB|SQ_FLAG_PREFAULT|SQ_FLAG_MLOCK|SQ_FLAG_READONLY|SQ_FLAGS_NUMA)
+
+// Counters kept in shm since the queue was created, see sq_get_stat()  运行统计
+struct sq_stat_t
+{
+	u64_t puts; // data put
+	u64_t put_bytes;
+	u64_t gets; // data read, by sq_get()/sq_peek() or by any of the subscribers
+	u64_t get_bytes;
+	u64_t full; // puts failed for the queue being full
+	u64_t cas_retries; // readers racing for head_pos and trying again
+	u64_t corrupted; // nodes skipped by the readers for a bad start token or length
+	u64_t signals; // wakeups sent to the readers, by signal, fd or futex
+	u64_t dropped; // data dropped by the writers with SQ_FLAG_OVERWRITE
+	u64_t expired; // data skipped by the readers for being older than the TTL, see sq_set_ttl()
+	u64_t high_water; // most nodes in use seen by the readers
+	int used_nodes; // nodes in use now
+	int ele_count;
+	int ele_size;
+	int flags;
+};
+
+// Histogram of the time from put to get of the data, with SQ_FLAG_LATENCY
+// Bucket i counts latencies up to sq_latency_value(i) ns, with 16 buckets for each power of 2 (6% precision)
+#define SQ_LATENCY_BUCKETS	544 // up to 2^37 ns, about 137 seconds, longer ones are counted in the last bucket
+
+struct sq_latency_t
+{
+	u64_t count;
+	u64_t total_ns; // for the mean
+	u64_t max_ns;
+	u64_t buckets[SQ_LATENCY_BUCKETS];
+};
+
 struct sq_head_t;
 
 // Create a shm queue
@@ -45,9 +120,35 @@ struct sq_head_t;
 // Returns a shm queue pointer or NULL if failed    
 struct sq_head_t *sq_create(u64_t shm_key, int ele_size, int ele_count);
 
+// Same as sq_create(), with flags being a combination of SQ_FLAG_XXX
+// An existing queue is only reused if it was created with the same flags, except SQ_FLAGS_ATTACH
+// Returns NULL if failed, sq_errorstr() tells why, e.g. mlock: Cannot allocate memory
+struct sq_head_t *sq_create_ex(u64_t shm_key, int ele_size, int ele_count, int flags);
+
 // Open an existing shm queue for reading data
 struct sq_head_t *sq_open(u64_t shm_key);
 
+// Same as sq_open(), with flags being SQ_FLAG_PREFAULT and/or SQ_FLAG_MLOCK
+// Returns NULL if failed, sq_errorstr() tells why, e.g. mlock: Cannot allocate memory
+struct sq_head_t *sq_open_ex(u64_t shm_key, int flags);
+
+// Queues in other kinds of shared memory than SysV shm, work the same way as sq_create_ex()/sq_open_ex()
+// POSIX shm: name is given to shm_open(), e.g. "/my_queue", not limited by SysV shmmax/shmall
+struct sq_head_t *sq_create_posix(const char *name, int ele_size, int ele_count, int flags);
+struct sq_head_t *sq_open_posix(const char *name, int flags);
+// Regular file mapped with MAP_SHARED: the queue and its data survive restarts of the system
+struct sq_head_t *sq_create_file(const char *path, int ele_size, int ele_count, int flags);
+struct sq_head_t *sq_open_file(const char *path, int flags);
+// memfd: the queue has no name, pass *fd to the readers through fork() or sq_send_fd()/sq_recv_fd()
+// sq_open_fd() opens a queue from such an fd (or an fd of a queue file), the fd can be closed afterwards
+struct sq_head_t *sq_create_memfd(const char *name, int ele_size, int ele_count, int flags, int *fd);
+struct sq_head_t *sq_open_fd(int fd, int flags);
+
+// Pass an fd to/from another process through a connected UNIX socket, e.g. one made by socketpair()
+// sq_send_fd() returns 0 on success, sq_recv_fd() returns the fd received, both return -1 if failed
+int sq_send_fd(int sock, int fd);
+int sq_recv_fd(int sock);
+
 // Set signal parameters if you wish to enable signaling on data write
 // Parameters:
 //      sq           - shm_queue pointer returned by sq_create
@@ -65,6 +166,19 @@ int sq_set_sigparam(struct sq_head_t *sq, int signum, int sig_ele_num, int sig_p
 // Returns a signal index for sq_sigon/sq_sigoff, or < 0 on failure
 int sq_register_signal(struct sq_head_t *sq);
 
+// Register the current process like sq_register_signal(), but instead of a signal,
+// get notified through a file descriptor which becomes readable when data arrives,
+// so that the queue can be waited in select/poll/epoll together with sockets
+// sig_ele_num/sig_proc_num set by sq_set_sigparam() apply as well, and data_signum is not needed
+// Parameters:
+//      sq  - shm_queue pointer returned by sq_open
+//      fd  - set to the notification fd on success
+// Returns a signal index for sq_sigon/sq_sigoff, or < 0 on failure
+// Note: as with signals, call sq_sigon() then retry sq_get() once before waiting on fd,
+//     and call sq_clear_fd() after fd becomes readable
+int sq_register_fd(struct sq_head_t *sq, int *fd);
+void sq_clear_fd(int fd);
+
 // Turn on/off signaling for current process
 // Parameters:
 //      sq  - shm_queue pointer returned by sq_open
@@ -73,25 +187,165 @@ int sq_register_signal(struct sq_head_t *sq);
 int sq_sigon(struct sq_head_t *sq, int sigindex);
 int sq_sigoff(struct sq_head_t *sq, int sigindex);
 
-// Destroy queue created by sq_create()
+// Block the calling reader until data arrives, without signal handlers
+// The writer only makes a wakeup syscall when some reader is waiting,
+// sig_ele_num/sig_proc_num set by sq_set_sigparam() apply to these wakeups too
+// Parameters:
+//      sq         - shm_queue pointer returned by sq_open
+//      timeout_ms - maximum milliseconds to wait, < 0 to wait forever
+// Returns 1 if there is data in queue, 0 on timeout or interrupted by a signal, -1 if parameter is bad
+int sq_wait(struct sq_head_t *sq);
+int sq_timedwait(struct sq_head_t *sq, int timeout_ms);
+
+// Destroy queue created by sq_create()/sq_open() etc., the queue itself stays in shm
 void sq_destroy(struct sq_head_t *queue);
 
+// Get the NUMA node where the data of queue are, so that the readers/writer can run nearby
+// Returns the node holding most of the data pages, or -1 if not known (e.g. no page is allocated yet)
+int sq_get_node(struct sq_head_t *queue);
+
 // Add data to end of shm queue
 // Returns 0 on success or
 //     -1 - invalid parameter
-//     -2 - shm queue is full
-// Note: here we assume only one process can put to the queue
-//     for multi-thread/process support, you need to introduce a lock by yourself
+//     -2 - shm queue is full, with SQ_FLAG_OVERWRITE only if the oldest data is being read,
+//          or not committed by another writer after yielding SQ_DROP_WAITS times
+// Note: by default we assume only one process can put to the queue,
+//     create the queue with SQ_FLAG_MULTI_PRODUCER for multi-thread/process support
 int sq_put(struct sq_head_t *queue, void *data, int datalen);
 
+// Add count data described by iov to end of shm queue at once
+// Readers are signaled only once for the whole batch
+// Returns the number of data added (less than count if the queue is full), or
+//     -1 - invalid parameter
+int sq_put_batch(struct sq_head_t *queue, const struct iovec *iov, int count);
+
+// Same as sq_put(), but if the queue is full, block until the readers free nodes, or timeout_ms milliseconds passed
+// The writer sleeps on a futex in shm, readers only make a wakeup syscall when some writer is sleeping,
+// and only once the used nodes drop to the low watermark set by sq_set_watermarks()
+// Returns 0 on success, -1 if parameter is bad, or -2 if still full on timeout or interrupted by a signal
+int sq_put_wait(struct sq_head_t *queue, void *data, int datalen, int timeout_ms);
+
+// Called in the writer process when the used nodes of queue reach the high watermark (high set), or drop back to the low one
+typedef void (*sq_watermark_fn)(struct sq_head_t *queue, int used_nodes, int high, void *arg);
+
+// Set the watermarks of queue in used nodes, 0 <= low < high <= ele_count
+// low applies to the writers blocked in sq_put_wait(), which are otherwise woken whenever nodes are freed
+// If fn is not NULL, the puts of this process check the watermarks and call fn(queue, used_nodes, high, arg) on crossing one,
+// so that the writer can shed or slow down load before the queue is full. fn is removed if NULL
+// Returns 0 on success, -1 if parameter is bad or too many queues have callbacks in this process
+int sq_set_watermarks(struct sq_head_t *queue, int high, int low, sq_watermark_fn fn, void *arg);
+
+// Set the time to live of the data in queue, 0 to turn it off
+// Readers (and subscribers) skip the data older than ttl_ms without copying them, counted in sq_stat_t.expired,
+// so that after a backlog only the fresh data take time. Not for queues created with SQ_FLAG_HEADER_NONE
+// Returns 0 on success, -1 if parameter is bad
+int sq_set_ttl(struct sq_head_t *queue, int ttl_ms);
+
+// Zero-copy version of sq_put(): reserve space in shm, write data into it, then commit or abort
+// sq_reserve() returns 0 with *data pointing to datalen bytes of continuous space, or
+//     -1 - invalid parameter
+//     -2 - shm queue is full
+// sq_commit() makes the first datalen bytes (no more than reserved) visible to the readers
+// sq_abort() gives up the reserved space
+// Both return 0 on success, -1 if parameter is bad
+// Note: in single producer mode the queue is left unchanged until sq_commit()/sq_abort(),
+//     so there can be only one outstanding reservation at a time
+int sq_reserve(struct sq_head_t *queue, int datalen, void **data);
+int sq_commit(struct sq_head_t *queue, void *data, int datalen);
+int sq_abort(struct sq_head_t *queue, void *data);
+
 // Retrieve data
 // On success, buf is filled with the first queue data
 // this function is multi-thread/multi-process safe
 // Returns the data length or
 //      0 - no data in queue
 //     -1 - invalid parameter
+//     -2 - buf_sz is too small, the data is dropped
 int sq_get(struct sq_head_t *queue, void *buf, int buf_sz, struct timeval *enqueue_time);
 
+// Retrieve up to max_count data at once, with a single CAS on the queue head
+// The data are copied to buf one after another, no more than buf_sz bytes in total,
+// lens[i] is set to the length of the i-th data, and enqueue_times[i] to its enqueue time if not NULL
+// this function is multi-thread/multi-process safe
+// Returns the number of data retrieved or
+//      0 - no data in queue
+//     -1 - invalid parameter
+//     -2 - the first data exceeds buf_sz, the data is dropped
+int sq_get_batch(struct sq_head_t *queue, void *buf, int buf_sz, int *lens, struct timeval *enqueue_times, int max_count);
+
+// Zero-copy version of sq_get()
+// On success, *data points to the first queue data in shm, no other reader will get it,
+// and the writer won't overwrite it until sq_release() is called
+// Note: the queue space after the data is not reused until it's released, if the reader process exits before that,
+//     the writer takes it back when the queue looks full. A thread of a running process never releasing it
+//     stops the writer for good once the queue is full, as does a reader process frozen in sq_get() etc.
+// this function is multi-thread/multi-process safe
+// Returns the data length or
+//      0 - no data in queue
+//     -1 - invalid parameter
+int sq_peek(struct sq_head_t *queue, void **data, struct timeval *enqueue_time);
+
+// Give the data returned by sq_peek() back to the writer, data may be released in any order
+// Returns 0 on success, -1 if parameter is bad
+int sq_release(struct sq_head_t *queue, void *data);
+
+// Large data beyond MAX_SQ_DATA_LENGTH, e.g. blobs of several MB, not for broadcast queues  大数据
+// sq_put_large() splits data into chunks of up to a quarter of the queue, and puts them one after another,
+// waiting up to timeout_ms milliseconds in all (forever if < 0) for the readers to free nodes, as sq_put_wait() does
+// Data fitting in a chunk is put as usual. Only one large data is put at a time, and in multi-producer mode
+// the other writers find the queue full meanwhile, so that the chunks are never mixed with other data
+// Returns 0 on success, -1 if parameter is bad, -2 on timeout, the chunks already put are dropped by the readers
+int sq_put_large(struct sq_head_t *queue, const void *data, int datalen, int timeout_ms);
+
+// Retrieve the next data, the chunks of large data are joined into buf
+// The reader taking the first chunk takes all the others, waiting up to timeout_ms milliseconds for them,
+// meanwhile the other readers get no data. Readers of a queue with large data should all use sq_get_large()/sq_peek_large(),
+// as sq_get() and the like never take the first chunk. The TTL set by sq_set_ttl() doesn't apply to large data
+// this function is multi-thread/multi-process safe
+// Returns the data length or
+//      0 - no data in queue
+//     -1 - invalid parameter
+//     -2 - buf_sz is too small, the data is dropped
+//     -3 - the rest of the large data didn't come in time or its writer is gone, the data is dropped
+int sq_get_large(struct sq_head_t *queue, void *buf, int buf_sz, struct timeval *enqueue_time, int timeout_ms);
+
+// Zero-copy version of sq_get_large(), iov[] are set to the parts of the data in shm, one for each chunk,
+// *iov_count is the size of iov[] on input, and the number of parts on output
+// The nodes are given back to the writer only by sq_release_large(), so the whole data must fit in the queue
+// Returns as sq_get_large(), with -2 if there are more parts than *iov_count or the data doesn't fit in the queue
+int sq_peek_large(struct sq_head_t *queue, struct iovec *iov, int *iov_count, struct timeval *enqueue_time, int timeout_ms);
+
+// Give the data returned by sq_peek_large() back to the writer
+// Returns 0 on success, -1 if parameter is bad
+int sq_release_large(struct sq_head_t *queue, const struct iovec *iov, int iov_count);
+
+// Broadcast queue (created with SQ_FLAG_BROADCAST): instead of competing for data through sq_get(),
+// each subscriber has its own cursor and reads every data put after it subscribed, without copying in shm
+// The writer reuses the space only after all subscribers have read it, when a subscriber is too slow,
+// sq_put() fails with -2, or with SQ_FLAG_EVICT_LAGGARDS, the subscriber is evicted and loses the data
+// Subscribers wait for data through sq_register_signal()/sq_register_fd()
+//
+// sq_subscribe() returns a subscriber index for the other sq_sub_xxx() functions, or < 0 on failure
+// sq_unsubscribe() returns 0 on success, -1 if parameter is bad
+int sq_subscribe(struct sq_head_t *queue);
+int sq_unsubscribe(struct sq_head_t *queue, int sub);
+
+// Retrieve the next data of subscriber sub
+// Returns the data length or
+//      0 - no data in queue
+//     -1 - invalid parameter
+//     -2 - buf_sz is too small, the data is skipped
+//     -3 - evicted by the writer, the data not read yet are lost and reading goes on from the tail
+int sq_sub_get(struct sq_head_t *queue, int sub, void *buf, int buf_sz, struct timeval *enqueue_time);
+
+// Zero-copy version of sq_sub_get()
+// *data points to the next data in shm, and sq_sub_release() moves the subscriber over it
+// sq_sub_peek() returns as sq_sub_get(), except that -2 is never returned
+// sq_sub_release() returns 0 on success, -1 if parameter is bad,
+//     or -3 if evicted, the data returned by sq_sub_peek() may have been overwritten
+int sq_sub_peek(struct sq_head_t *queue, int sub, void **data, struct timeval *enqueue_time);
+int sq_sub_release(struct sq_head_t *queue, int sub);
+
 // Get usage rate
 // Returns a number from 0 to 99
 int sq_get_usage(struct sq_head_t *queue);
@@ -99,8 +353,31 @@ int sq_get_usage(struct sq_head_t *queue);
 // Get number of used blocks
 int sq_get_used_blocks(struct sq_head_t *queue);
 
+// Sum up the counters of queue into *stat, also works on a queue opened with SQ_FLAG_READONLY
+// Returns 0 on success, -1 if parameter is bad
+int sq_get_stat(struct sq_head_t *queue, struct sq_stat_t *stat);
+
+// Sum up the latency histogram of queue (created with SQ_FLAG_LATENCY) into *lat,
+// also works on a queue opened with SQ_FLAG_READONLY
+// Returns 0 on success, -1 if parameter is bad or the queue has no histogram
+int sq_get_latency(struct sq_head_t *queue, struct sq_latency_t *lat);
+
+// Returns the latency in ns that percent (0-100) of the data in lat didn't exceed, 0 if lat is empty
+// The histogram of an interval can be taken by subtracting the buckets of two sq_get_latency() results
+u64_t sq_latency_percentile(const struct sq_latency_t *lat, double percent);
+
+// Returns the largest latency in ns counted in bucket idx
+u64_t sq_latency_value(int idx);
+
+// Returns the bucket ns is counted in, for keeping a histogram of your own in struct sq_latency_t
+int sq_latency_bucket(u64_t ns);
+
 // If a queue operation failed, call this function to get an error reason
 const char *sq_errorstr();
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
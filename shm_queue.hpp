@@ -0,0 +1,235 @@
+/*
+ * shm_queue.hpp
+ * C++ RAII wrapper of the shm queue, header only
+ *
+ *  sq::queue<ElementSize, Capacity, Producer> wraps a struct sq_head_t:
+ *  1) queue parameters are checked at compile time, and the queue is always created with SQ_FLAG_POW2,
+ *     so that the library does no division on the hot path   编译期确定队列参数
+ *     the hot path itself is the C library's, the parameters only pick the flags and verify the queue opened
+ *  2) the shm is attached in the constructor and detached in the destructor   RAII
+ *  3) typed push<T>()/emplace<T>()/pop<T>() for trivially copyable types
+ *  4) zero-copy reads through sq::message, released back to the writer when it goes out of scope
+ */
+#ifndef __SHM_QUEUE_HPP__
+#define __SHM_QUEUE_HPP__
+
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#include "shm_queue.h"
+
+namespace sq
+{
+
+// Whether several processes may put into the queue, i.e. SQ_FLAG_MULTI_PRODUCER
+// Any number of readers may get from any queue, so there is nothing to choose for the consumers
+enum class producer
+{
+	single,
+	multi,
+};
+
+// Smallest power of 2 no less than n
+constexpr int round_pow2(int n)
+{
+	return n&(n-1)? round_pow2((n|(n-1))+1) : n;
+}
+
+class error : public std::runtime_error
+{
+public:
+	error(const char *what) : std::runtime_error(std::string(what) + ": " + sq_errorstr()) {}
+	explicit error(const std::string &what) : std::runtime_error(what) {}
+};
+
+// Data returned by queue::peek(), given back to the writer when destroyed
+class message
+{
+public:
+	message() : queue_(NULL), data_(NULL), len_(0) {}
+	message(struct sq_head_t *queue, void *data, int len) : queue_(queue), data_(data), len_(len) {}
+	message(message &&other) : queue_(other.queue_), data_(other.data_), len_(other.len_) { other.queue_ = NULL; }
+	message &operator=(message &&other)
+	{
+		if(this!=&other)
+		{
+			release();
+			queue_ = other.queue_; data_ = other.data_; len_ = other.len_;
+			other.queue_ = NULL;
+		}
+		return *this;
+	}
+	message(const message &) = delete;
+	message &operator=(const message &) = delete;
+	~message() { release(); }
+
+	explicit operator bool() const { return queue_!=NULL; }
+	const void *data() const { return data_; }
+	int size() const { return len_; }
+
+#if __cplusplus >= 202002L
+	std::span<const std::byte> bytes() const { return std::span<const std::byte>((const std::byte *)data_, queue_? len_ : 0); }
+#endif
+
+	// Returns the data as a T, or NULL if the length doesn't match
+	template<typename T> const T *as() const
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be read from shm");
+		return queue_ && len_==(int)sizeof(T)? (const T *)data_ : NULL;
+	}
+
+	// Give the data back to the writer now
+	void release()
+	{
+		if(queue_)
+			sq_release(queue_, data_);
+		queue_ = NULL;
+	}
+
+private:
+	struct sq_head_t *queue_;
+	void *data_;
+	int len_;
+};
+
+template<int ElementSize, int Capacity, producer Producer = producer::single>
+class queue
+{
+public:
+	static_assert(ElementSize>0 && ElementSize<=MAX_SQ_DATA_LENGTH, "bad element size");
+	static_assert(Capacity>0 && Capacity<=(1<<30), "bad capacity");
+
+	static constexpr int element_size = ElementSize;
+	// number of elements, rounded up like SQ_FLAG_POW2 does
+	static constexpr int capacity = round_pow2(Capacity);
+	static constexpr int flags = SQ_FLAG_POW2 | (Producer==producer::multi? SQ_FLAG_MULTI_PRODUCER : 0);
+	// element size in shm, rounded up so that a node with the full header is a power of 2
+	static constexpr int node_head_size = 2*sizeof(u32_t) + sizeof(struct timeval);
+	static constexpr int rounded_size = round_pow2(ElementSize + node_head_size) - node_head_size;
+
+	// Create the queue, or attach to the existing one if it has the same parameters
+	static queue create(u64_t shm_key)
+	{
+		struct sq_head_t *q = sq_create_ex(shm_key, ElementSize, Capacity, flags);
+		if(q==NULL)
+			throw error("sq_create_ex");
+		return queue(q);
+	}
+
+	// Attach to an existing queue for reading, which must have been created with the same parameters
+	static queue open(u64_t shm_key)
+	{
+		struct sq_stat_t st;
+		struct sq_head_t *q = sq_open(shm_key);
+		if(q==NULL)
+			throw error("sq_open");
+		queue ret(q); // detached if thrown below
+		if(sq_get_stat(q, &st)<0)
+			throw error("sq_get_stat");
+		if(st.ele_size!=rounded_size || st.ele_count!=capacity || (st.flags & (SQ_FLAG_POW2|SQ_FLAG_MULTI_PRODUCER))!=flags)
+			throw error("sq_open: queue parameters mismatched, ele_size " + std::to_string(st.ele_size) +
+				", ele_count " + std::to_string(st.ele_count) + ", flags " + std::to_string(st.flags));
+		return ret;
+	}
+
+	queue(queue &&other) : queue_(other.queue_) { other.queue_ = NULL; }
+	queue &operator=(queue &&other) { std::swap(queue_, other.queue_); return *this; }
+	queue(const queue &) = delete;
+	queue &operator=(const queue &) = delete;
+	~queue()
+	{
+		if(queue_)
+			sq_destroy(queue_);
+	}
+
+	struct sq_head_t *handle() const { return queue_; }
+
+	// Returns false if the queue is full
+	bool push(const void *data, int len)
+	{
+		int ret = sq_put(queue_, (void *)data, len);
+		if(ret==-1)
+			throw error("sq_put");
+		return ret==0;
+	}
+
+	template<typename T> bool push(const T &val)
+	{
+		check_type<T>();
+		return push(&val, (int)sizeof(T));
+	}
+
+	// Construct a T in shm directly, returns false if the queue is full
+	template<typename T, typename... Args> bool emplace(Args&&... args)
+	{
+		void *buf;
+
+		check_type<T>();
+		// node data is 8 bytes aligned
+		static_assert(alignof(T)<=8, "over-aligned types can't be placed in shm");
+		int ret = sq_reserve(queue_, (int)sizeof(T), &buf);
+		if(ret==-2)
+			return false;
+		if(ret<0)
+			throw error("sq_reserve");
+		try
+		{
+			new(buf) T(std::forward<Args>(args)...);
+		}
+		catch(...)
+		{
+			sq_abort(queue_, buf); // or the space is never given back in single producer mode
+			throw;
+		}
+		sq_commit(queue_, buf, (int)sizeof(T));
+		return true;
+	}
+
+	// Returns the data length as sq_get() does
+	int pop(void *buf, int buf_sz, struct timeval *enqueue_time = NULL)
+	{
+		return sq_get(queue_, buf, buf_sz, enqueue_time);
+	}
+
+	// Returns true if a T is read, data of another length is dropped
+	template<typename T> bool pop(T &val, struct timeval *enqueue_time = NULL)
+	{
+		check_type<T>();
+		return pop(&val, (int)sizeof(T), enqueue_time)==(int)sizeof(T);
+	}
+
+	// Zero-copy read, the returned message is empty if there is no data
+	message peek(struct timeval *enqueue_time = NULL)
+	{
+		void *data;
+		int len = sq_peek(queue_, &data, enqueue_time);
+		return len>0? message(queue_, data, len) : message();
+	}
+
+	// Returns true if there is data in queue, see sq_timedwait()
+	bool wait(int timeout_ms = -1) { return sq_timedwait(queue_, timeout_ms)>0; }
+
+	int used_blocks() const { return sq_get_used_blocks(queue_); }
+
+private:
+	explicit queue(struct sq_head_t *q) : queue_(q) {}
+
+	template<typename T> static void check_type()
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types can be put into shm");
+		static_assert(sizeof(T)<=MAX_SQ_DATA_LENGTH, "type too large for a queue data");
+	}
+
+	struct sq_head_t *queue_;
+};
+
+}
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * sq_bench.c
+ * Throughput and latency benchmark of the shm queue
+ *
+ *  Writer and reader processes are forked on a fresh queue, every message carries the time it was put,
+ *  the readers record the end-to-end latency in the histogram layout of sq_get_latency() (about 6% precision)
+ *  With flags dropping data (SQ_FLAG_OVERWRITE) the readers stop when the writers are done and the queue is empty,
+ *  the data dropped are reported from sq_get_stat()
+ *  Results are printed as one JSON line starting with '{', e.g. for scripts:
+ *      ./sq_bench -w 2 -r 2 -s 16-1024 -m futex | grep '^{'
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "shm_queue.h"
+
+#define MAX_PROCS	64
+#define MAX_SIZES	16
+
+
+enum { WAKE_SPIN, WAKE_YIELD, WAKE_FUTEX, WAKE_SIGNAL, WAKE_FD };
+static const char *wake_names[] = {"spin", "yield", "futex", "signal", "fd"};
+
+// shared by all the processes, mapped before fork()
+struct bench_shared_t
+{
+	volatile int ready; // number of processes ready to go
+	volatile int go;
+	volatile long received; // messages read by all the readers
+	volatile long full; // sq_put() found the queue full
+	volatile int writers_done;
+	volatile u64_t start_ns;
+	struct
+	{
+		long msgs, bytes;
+		u64_t lat_min;
+		u64_t end_ns; // when the last message was read
+		struct sq_latency_t lat;
+	} readers[MAX_PROCS];
+};
+
+static struct
+{
+	int writers, readers;
+	long count; // messages per writer
+	int ele_size, ele_count, flags;
+	int wakeup, batch;
+	long rate; // messages per second per writer, 0 for as fast as possible
+	u64_t key;
+	const char *size_spec;
+	int nsizes, min_size[MAX_SIZES], max_size[MAX_SIZES];
+	int largest;
+} conf = {.writers = 1, .readers = 1, .count = 1000000, .ele_size = 64, .ele_count = 65536,
+	.wakeup = WAKE_FUTEX, .batch = 1, .key = 0x5142, .size_spec = "64"};
+
+static struct bench_shared_t *shared;
+
+static u64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// The histogram keeps the upper bound of each bucket, never report more than the largest one seen
+static u64_t percentile(const struct sq_latency_t *lat, double pct)
+{
+	u64_t v = sq_latency_percentile(lat, pct);
+	return v<lat->max_ns? v : lat->max_ns;
+}
+
+// Parse a comma separated list of sizes or size ranges, e.g. "64" or "16-256,4096",
+// each message picks an item at random, then a size in the range at random
+static int parse_sizes(const char *spec)
+{
+	const char *p = spec;
+	char *end;
+
+	conf.nsizes = 0;
+	conf.largest = 0;
+	while(*p)
+	{
+		if(conf.nsizes==MAX_SIZES)
+			return -1;
+		conf.min_size[conf.nsizes] = conf.max_size[conf.nsizes] = strtol(p, &end, 10);
+		if(*end=='-')
+			conf.max_size[conf.nsizes] = strtol(end+1, &end, 10);
+		if(end==p || (*end && *end!=',') || conf.min_size[conf.nsizes]<(int)sizeof(u64_t) ||
+			conf.max_size[conf.nsizes]<conf.min_size[conf.nsizes] || conf.max_size[conf.nsizes]>MAX_SQ_DATA_LENGTH)
+			return -1;
+		if(conf.max_size[conf.nsizes]>conf.largest)
+			conf.largest = conf.max_size[conf.nsizes];
+		conf.nsizes ++;
+		p = *end? end+1 : end;
+	}
+	return conf.nsizes? 0 : -1;
+}
+
+static inline u32_t xorshift(u32_t *s)
+{
+	*s ^= *s<<13;
+	*s ^= *s>>17;
+	*s ^= *s<<5;
+	return *s;
+}
+
+static void wait_for_go()
+{
+	__sync_fetch_and_add(&shared->ready, 1);
+	while(!shared->go)
+		sched_yield();
+}
+
+static void run_writer(struct sq_head_t *queue, int id)
+{
+	static char buf[MAX_SQ_DATA_LENGTH];
+	u32_t seed = 2463534242U + id;
+	u64_t start, ts;
+	long i;
+	int len, k;
+
+	wait_for_go();
+	start = now_ns();
+	for(i=0; i<conf.count; i++)
+	{
+		k = conf.nsizes>1? xorshift(&seed)%conf.nsizes : 0;
+		len = conf.min_size[k];
+		if(conf.max_size[k]>len)
+			len += xorshift(&seed)%(conf.max_size[k]-len+1);
+		if(conf.rate>0) // pace the messages evenly
+			while(now_ns()-start < (u64_t)(i*1000000000.0/conf.rate));
+		while(1)
+		{
+			ts = now_ns();
+			memcpy(buf, &ts, sizeof(ts));
+			if(sq_put(queue, buf, len)==0)
+				break;
+			__sync_fetch_and_add(&shared->full, 1);
+			sched_yield();
+		}
+	}
+	__sync_fetch_and_add(&shared->writers_done, 1);
+}
+
+// dummy signal handler, sleeping is interrupted by SIGUSR1
+static void siguser1(int signo)
+{
+	(void)signo;
+}
+
+static void run_reader(struct sq_head_t *queue, int id)
+{
+	long total = (long)conf.writers*conf.count;
+	int buf_sz = conf.largest*conf.batch;
+	char *buf = malloc(buf_sz);
+	int *lens = malloc(sizeof(int)*conf.batch);
+	int sigindex = -1, fd = -1, n, i, off, done;
+	struct pollfd pfd;
+	u64_t ts, now, lat;
+	typeof(&shared->readers[0]) st = &shared->readers[id];
+
+	st->lat_min = (u64_t)-1;
+	if(conf.wakeup==WAKE_SIGNAL)
+	{
+		signal(SIGUSR1, siguser1);
+		sigindex = sq_register_signal(queue);
+	}
+	else if(conf.wakeup==WAKE_FD)
+	{
+		sigindex = sq_register_fd(queue, &fd);
+	}
+	if(sigindex<0 && (conf.wakeup==WAKE_SIGNAL || conf.wakeup==WAKE_FD))
+	{
+		printf("reader %d: register failed: %s\n", id, sq_errorstr());
+		exit(1);
+	}
+
+	wait_for_go();
+	while(shared->received<total)
+	{
+		// checked before reading, so no message put before the writers are done is missed
+		done = shared->writers_done==conf.writers;
+		if(conf.batch>1)
+			n = sq_get_batch(queue, buf, buf_sz, lens, NULL, conf.batch);
+		else if((n = sq_get(queue, buf, buf_sz, NULL))>0)
+		{
+			lens[0] = n;
+			n = 1;
+		}
+		if(n<0)
+		{
+			printf("reader %d: sq_get failed: %s\n", id, sq_errorstr());
+			exit(1);
+		}
+		if(n>0)
+		{
+			now = now_ns();
+			for(i=0, off=0; i<n; off+=lens[i++])
+			{
+				memcpy(&ts, buf+off, sizeof(ts));
+				lat = now>ts? now-ts : 0;
+				st->lat.buckets[sq_latency_bucket(lat)] ++;
+				st->lat.count ++;
+				st->lat.total_ns += lat;
+				if(lat>st->lat.max_ns)
+					st->lat.max_ns = lat;
+				if(lat<st->lat_min)
+					st->lat_min = lat;
+				st->bytes += lens[i];
+			}
+			st->msgs += n;
+			st->end_ns = now;
+			__sync_add_and_fetch(&shared->received, n);
+			continue;
+		}
+		if(done) // the rest are dropped
+			break;
+
+		// the queue is empty, the timeouts make sure readers find out when all the messages are read
+		switch(conf.wakeup)
+		{
+		case WAKE_SPIN:
+			break;
+		case WAKE_YIELD:
+			sched_yield();
+			break;
+		case WAKE_FUTEX:
+			sq_timedwait(queue, 10);
+			break;
+		case WAKE_SIGNAL:
+			sq_sigon(queue, sigindex);
+			if(sq_get_used_blocks(queue)==0) // retry once after switching on the signal
+				usleep(10000);
+			sq_sigoff(queue, sigindex);
+			break;
+		case WAKE_FD:
+			sq_sigon(queue, sigindex);
+			if(sq_get_used_blocks(queue)==0)
+			{
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				if(poll(&pfd, 1, 10)>0)
+					sq_clear_fd(fd);
+			}
+			sq_sigoff(queue, sigindex);
+			break;
+		}
+	}
+}
+
+static void remove_shm()
+{
+	int shmid = shmget(conf.key, 0, 0);
+	if(shmid>=0)
+		shmctl(shmid, IPC_RMID, NULL);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [options]\n", prog);
+	printf("  -w writers      number of writer processes (1)\n");
+	printf("  -r readers      number of reader processes (1)\n");
+	printf("  -n count        messages per writer (1000000)\n");
+	printf("  -s sizes        message sizes, comma separated sizes or ranges, e.g. 64 or 16-256,4096 (64)\n");
+	printf("  -e ele_size     element size of the queue (64)\n");
+	printf("  -c ele_count    element count of the queue (65536)\n");
+	printf("  -f flags        extra SQ_FLAG_XXX for sq_create_ex(), e.g. 0x2 for SQ_FLAG_POW2 (0),\n");
+	printf("                  data dropped, e.g. with SQ_FLAG_OVERWRITE, are reported as \"dropped\"\n");
+	printf("  -m wakeup       how readers wait for data: spin, yield, futex, signal or fd (futex)\n");
+	printf("  -b batch        read up to batch messages with sq_get_batch() (1)\n");
+	printf("  -R rate         messages per second per writer, 0 for no limit (0)\n");
+	printf("  -k key          shm key, the queue is removed before and after the run (0x5142)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sq_head_t *queue;
+	struct sq_latency_t lat;
+	struct sq_stat_t stat;
+	u64_t lat_min = (u64_t)-1, end_ns = 0;
+	long msgs = 0, bytes = 0;
+	double secs;
+	int i, j, opt, nprocs, status, failed = 0;
+
+	while((opt = getopt(argc, argv, "w:r:n:s:e:c:f:m:b:R:k:h"))!=-1)
+	{
+		switch(opt)
+		{
+		case 'w': conf.writers = atoi(optarg); break;
+		case 'r': conf.readers = atoi(optarg); break;
+		case 'n': conf.count = atol(optarg); break;
+		case 's': conf.size_spec = optarg; break;
+		case 'e': conf.ele_size = atoi(optarg); break;
+		case 'c': conf.ele_count = atoi(optarg); break;
+		case 'f': conf.flags = strtol(optarg, NULL, 0); break;
+		case 'b': conf.batch = atoi(optarg); break;
+		case 'R': conf.rate = atol(optarg); break;
+		case 'k': conf.key = strtoull(optarg, NULL, 0); break;
+		case 'm':
+			for(conf.wakeup=0; conf.wakeup<(int)(sizeof(wake_names)/sizeof(wake_names[0])); conf.wakeup++)
+				if(strcmp(optarg, wake_names[conf.wakeup])==0)
+					break;
+			if(conf.wakeup==(int)(sizeof(wake_names)/sizeof(wake_names[0])))
+				goto badarg;
+			break;
+		default:
+			goto badarg;
+		}
+	}
+	if(conf.writers<1 || conf.readers<1 || conf.writers+conf.readers>MAX_PROCS || conf.count<1 ||
+		conf.batch<1 || conf.rate<0 || parse_sizes(conf.size_spec)<0)
+	{
+badarg:
+		usage(argv[0]);
+		return -1;
+	}
+	if(conf.writers>1)
+		conf.flags |= SQ_FLAG_MULTI_PRODUCER;
+
+	shared = mmap(NULL, sizeof(*shared), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(shared==MAP_FAILED)
+	{
+		perror("mmap");
+		return -1;
+	}
+	remove_shm();
+	queue = sq_create_ex(conf.key, conf.ele_size, conf.ele_count, conf.flags);
+	if(queue==NULL)
+	{
+		printf("failed to create shm queue: %s\n", sq_errorstr());
+		return -1;
+	}
+	if(conf.wakeup==WAKE_SIGNAL || conf.wakeup==WAKE_FD)
+		sq_set_sigparam(queue, SIGUSR1, 0, 1);
+
+	nprocs = conf.writers + conf.readers;
+	for(i=0; i<nprocs; i++)
+	{
+		pid_t pid = fork();
+		if(pid<0)
+		{
+			perror("fork");
+			return -1;
+		}
+		if(pid==0)
+		{
+			if(i<conf.readers)
+				run_reader(queue, i);
+			else
+				run_writer(queue, i-conf.readers);
+			fflush(stdout);
+			_exit(0);
+		}
+	}
+	while(shared->ready<nprocs)
+		usleep(1000);
+	shared->start_ns = now_ns();
+	shared->go = 1;
+	while(wait(&status)>0)
+		if(!WIFEXITED(status) || WEXITSTATUS(status)!=0)
+			failed = 1;
+	sq_get_stat(queue, &stat);
+	sq_destroy(queue);
+	remove_shm();
+	if(failed)
+		return -1;
+
+	memset(&lat, 0, sizeof(lat));
+	for(i=0; i<conf.readers; i++)
+	{
+		msgs += shared->readers[i].msgs;
+		bytes += shared->readers[i].bytes;
+		lat.count += shared->readers[i].lat.count;
+		lat.total_ns += shared->readers[i].lat.total_ns;
+		if(shared->readers[i].lat.max_ns>lat.max_ns)
+			lat.max_ns = shared->readers[i].lat.max_ns;
+		if(shared->readers[i].lat_min<lat_min)
+			lat_min = shared->readers[i].lat_min;
+		if(shared->readers[i].end_ns>end_ns)
+			end_ns = shared->readers[i].end_ns;
+		for(j=0; j<SQ_LATENCY_BUCKETS; j++)
+			lat.buckets[j] += shared->readers[i].lat.buckets[j];
+	}
+	if(msgs==0)
+	{
+		printf("no message read, %llu dropped\n", (unsigned long long)(stat.dropped+stat.expired));
+		return -1;
+	}
+	secs = (end_ns - shared->start_ns)/1e9;
+
+	printf("{\"writers\":%d,\"readers\":%d,\"messages\":%ld,\"sizes\":\"%s\",\"ele_size\":%d,\"ele_count\":%d,"
+		"\"flags\":%d,\"wakeup\":\"%s\",\"batch\":%d,\"rate\":%ld,"
+		"\"elapsed_s\":%.6f,\"msgs_per_s\":%.0f,\"bytes_per_s\":%.0f,\"full_retries\":%ld,\"dropped\":%llu,"
+		"\"lat_min_ns\":%llu,\"lat_mean_ns\":%llu,\"lat_p50_ns\":%llu,\"lat_p99_ns\":%llu,\"lat_p999_ns\":%llu,\"lat_max_ns\":%llu}\n",
+		conf.writers, conf.readers, msgs, conf.size_spec, conf.ele_size, conf.ele_count,
+		conf.flags, wake_names[conf.wakeup], conf.batch, conf.rate,
+		secs, msgs/secs, bytes/secs, shared->full, (unsigned long long)(stat.dropped+stat.expired),
+		lat_min, lat.total_ns/msgs, percentile(&lat, 50), percentile(&lat, 99), percentile(&lat, 99.9), lat.max_ns);
+	return 0;
+}
@@ -0,0 +1,117 @@
+/*
+ * sq_stat.c
+ * Watch a live shm queue, like top
+ *
+ *  The queue is opened read-only, nothing in it is changed
+ *  The totals since creation are printed first, then the rates of each interval,
+ *  and the latency percentiles of the interval for a queue created with SQ_FLAG_LATENCY
+ *      ./sq_stat 0x1234
+ *      ./sq_stat -i 5 -c 12 -p /my_queue
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "shm_queue.h"
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [-i interval] [-c count] <key> | -p <posix_name> | -f <path>\n", prog);
+	printf("  -i interval     seconds between samples (1)\n");
+	printf("  -c count        number of samples, 0 for forever (0)\n");
+	printf("  -p posix_name   open the queue from POSIX shm, see sq_open_posix()\n");
+	printf("  -f path         open the queue from a file, see sq_open_file()\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sq_head_t *queue;
+	struct sq_stat_t prev, cur;
+	static struct sq_latency_t prev_lat, cur_lat, lat;
+	const char *posix_name = NULL, *path = NULL;
+	int interval = 1, count = 0, opt, i, j, has_lat;
+	char tbuf[16];
+	time_t now;
+	double t;
+
+	while((opt = getopt(argc, argv, "i:c:p:f:h"))!=-1)
+	{
+		switch(opt)
+		{
+		case 'i': interval = atoi(optarg); break;
+		case 'c': count = atoi(optarg); break;
+		case 'p': posix_name = optarg; break;
+		case 'f': path = optarg; break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+	if(interval<1 || count<0 || (posix_name==NULL && path==NULL && optind!=argc-1))
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if(posix_name)
+		queue = sq_open_posix(posix_name, SQ_FLAG_READONLY);
+	else if(path)
+		queue = sq_open_file(path, SQ_FLAG_READONLY);
+	else
+		queue = sq_open_ex(strtoull(argv[optind], NULL, 0), SQ_FLAG_READONLY);
+	if(queue==NULL)
+	{
+		printf("failed to open shm queue: %s\n", sq_errorstr());
+		return -1;
+	}
+
+	sq_get_stat(queue, &prev);
+	printf("ele_size=%d ele_count=%d flags=0x%x\n", prev.ele_size, prev.ele_count, prev.flags);
+	printf("total: puts=%llu put_bytes=%llu gets=%llu get_bytes=%llu full=%llu cas_retries=%llu corrupted=%llu signals=%llu dropped=%llu expired=%llu high_water=%llu\n",
+		prev.puts, prev.put_bytes, prev.gets, prev.get_bytes, prev.full, prev.cas_retries, prev.corrupted, prev.signals, prev.dropped, prev.expired,
+		prev.high_water);
+	has_lat = sq_get_latency(queue, &prev_lat)==0;
+	if(has_lat)
+		printf("latency: count=%llu mean=%lluns p50=%lluns p99=%lluns p99.9=%lluns max=%lluns\n", prev_lat.count,
+			prev_lat.count? prev_lat.total_ns/prev_lat.count : 0, sq_latency_percentile(&prev_lat, 50),
+			sq_latency_percentile(&prev_lat, 99), sq_latency_percentile(&prev_lat, 99.9), prev_lat.max_ns);
+
+	for(i=0; count==0 || i<count; i++)
+	{
+		if(i%20==0)
+		{
+			printf("%-8s %8s %5s %8s %10s %10s %9s %9s %8s %8s %8s %8s %8s %8s", "time", "used", "use%", "hwm",
+				"put/s", "get/s", "inMB/s", "outMB/s", "full/s", "retry/s", "corrupt", "wake/s", "drop/s", "expire/s");
+			if(has_lat)
+				printf(" %10s %10s %10s", "p50_us", "p99_us", "p99.9_us");
+			printf("\n");
+		}
+		sleep(interval);
+		sq_get_stat(queue, &cur);
+		now = time(NULL);
+		strftime(tbuf, sizeof(tbuf), "%H:%M:%S", localtime(&now));
+		t = interval;
+		printf("%-8s %8d %5d %8llu %10.0f %10.0f %9.2f %9.2f %8.0f %8.0f %8llu %8.0f %8.0f %8.0f", tbuf,
+			cur.used_nodes, cur.ele_count? (int)(cur.used_nodes*100LL/cur.ele_count) : 0, cur.high_water,
+			(cur.puts-prev.puts)/t, (cur.gets-prev.gets)/t,
+			(cur.put_bytes-prev.put_bytes)/t/(1<<20), (cur.get_bytes-prev.get_bytes)/t/(1<<20),
+			(cur.full-prev.full)/t, (cur.cas_retries-prev.cas_retries)/t,
+			cur.corrupted-prev.corrupted, (cur.signals-prev.signals)/t, (cur.dropped-prev.dropped)/t, (cur.expired-prev.expired)/t);
+		if(has_lat)
+		{
+			sq_get_latency(queue, &cur_lat);
+			for(j=0; j<SQ_LATENCY_BUCKETS; j++) // histogram of this interval
+				lat.buckets[j] = cur_lat.buckets[j]-prev_lat.buckets[j];
+			printf(" %10.1f %10.1f %10.1f", sq_latency_percentile(&lat, 50)/1e3,
+				sq_latency_percentile(&lat, 99)/1e3, sq_latency_percentile(&lat, 99.9)/1e3);
+			prev_lat = cur_lat;
+		}
+		printf("\n");
+		fflush(stdout);
+		prev = cur;
+	}
+	sq_destroy(queue);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * test_overwrite.c
+ * Stress test of SQ_FLAG_OVERWRITE with several producers: the writers must never find the queue full
+ *
+ *  usage: test_overwrite [writers] [readers] [puts per writer] [batch]
+ *  exits with 1 if any sq_put()/sq_put_batch() failed to put its data
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "shm_queue.h"
+
+static struct sq_head_t *sq;
+static int nr_puts = 100000, batch = 1;
+static volatile int writers_left;
+static volatile long failed, got;
+
+static void *writer(void *arg)
+{
+	char data[8][100];
+	struct iovec iov[8];
+	int i, n, k;
+
+	for(k=0; k<8; k++)
+	{
+		memset(data[k], 'a'+k, sizeof(data[k]));
+		iov[k].iov_base = data[k];
+		iov[k].iov_len = 20+k*10; // 1 or 2 nodes each
+	}
+	for(i=0; i<nr_puts; i+=n)
+	{
+		n = nr_puts-i<batch? nr_puts-i : batch;
+		if(batch==1)
+			k = sq_put(sq, data[i%8], 20+(i%8)*10)==0? 1 : 0;
+		else
+			k = sq_put_batch(sq, iov, n);
+		if(k<n)
+		{
+			__sync_fetch_and_add(&failed, n-(k>0? k : 0));
+			if(failed<=3)
+				printf("writer %ld: put %d of %d: %s\n", (long)arg, k, n, sq_errorstr());
+		}
+	}
+	__sync_fetch_and_sub(&writers_left, 1);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	char buf[MAX_SQ_DATA_LENGTH];
+	int len;
+
+	(void)arg;
+	while(writers_left || sq_get_used_blocks(sq)>0)
+	{
+		if((len = sq_get(sq, buf, sizeof(buf), NULL))>0)
+			__sync_fetch_and_add(&got, 1);
+		else if(len<0)
+		{
+			printf("sq_get: %s\n", sq_errorstr());
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int writers = argc>1? atoi(argv[1]) : 3, readers = argc>2? atoi(argv[2]) : 0;
+	pthread_t tids[64];
+	struct sq_stat_t st;
+	int i, fd;
+
+	if(argc>3)
+		nr_puts = atoi(argv[3]);
+	if(argc>4)
+		batch = atoi(argv[4]);
+	if(writers<1 || readers<0 || writers+readers>64 || nr_puts<1 || batch<1 || batch>8)
+	{
+		printf("usage: %s [writers] [readers] [puts per writer] [batch, up to 8]\n", argv[0]);
+		return 1;
+	}
+	if((sq = sq_create_memfd("test_overwrite", 64, 1024, SQ_FLAG_OVERWRITE|SQ_FLAG_MULTI_PRODUCER, &fd))==NULL)
+	{
+		printf("sq_create_memfd: %s\n", sq_errorstr());
+		return 1;
+	}
+
+	writers_left = writers;
+	for(i=0; i<writers+readers; i++)
+		pthread_create(tids+i, NULL, i<writers? writer : reader, (void*)(long)i);
+	for(i=0; i<writers+readers; i++)
+		pthread_join(tids[i], NULL);
+
+	sq_get_stat(sq, &st);
+	printf("writers %d readers %d batch %d: puts %llu dropped %llu got %ld failed %ld\n", writers, readers, batch,
+		(unsigned long long)st.puts, (unsigned long long)st.dropped, got, failed);
+	sq_destroy(sq);
+	close(fd);
+	return failed? 1 : 0;
+}